@@ -0,0 +1,459 @@
+// fastabench: time the FASTA library on a synthetic reference.
+//
+// A reference of random bases is generated with the requested number of
+// contigs, contig length, line width and line endings.  Every base is a
+// function of its contig and position, so any result can be checked without
+// keeping the sequence in memory.  Each benchmark prints one JSON object per
+// line on stdout.
+//
+// With --large, a second reference holding one contig longer than 2^31 bases
+// is generated as well, and regions past that offset are fetched from it, to
+// exercise 64-bit coordinates end to end.  It is removed afterwards.
+
+#include "Fasta.h"
+#include "Parallel.h"
+#include <getopt.h>
+#include <chrono>
+#include <random>
+#include <sstream>
+
+using namespace std::chrono;
+
+static double secondsSince(steady_clock::time_point start) {
+    return duration<double>(steady_clock::now() - start).count();
+}
+
+static uint64_t splitmix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// the synthetic reference: contig c is named "contig<c>", and its base at
+// pos comes from a hash of the seed, c and pos, 32 bases per hash
+struct SyntheticReference {
+    uint64_t seed;
+    int contigs;
+    long long length;
+    int lineWidth;
+    bool crlf;
+    char base(int contig, long long pos) const {
+        uint64_t bits = splitmix64(seed ^ ((uint64_t) contig << 40) ^ (uint64_t) (pos / 32));
+        return "ACGT"[(bits >> (2 * (pos % 32))) & 3];
+    }
+    string name(int contig) const {
+        ostringstream s;
+        s << "contig" << contig;
+        return s.str();
+    }
+    void write(const string& filename) const {
+        FILE* out = fopen(filename.c_str(), "wb");
+        if (out == NULL) {
+            cerr << "could not open " << filename << " for writing!" << endl;
+            exit(1);
+        }
+        const char* newline = crlf ? "\r\n" : "\n";
+        vector<char> line(lineWidth);
+        for (int c = 0; c < contigs; ++c) {
+            fprintf(out, ">%s synthetic%s", name(c).c_str(), newline);
+            for (long long pos = 0; pos < length; pos += lineWidth) {
+                int n = min((long long) lineWidth, length - pos);
+                for (int i = 0; i < n; ++i) {
+                    line[i] = base(c, pos + i);
+                }
+                fwrite(&line[0], 1, n, out);
+                fputs(newline, out);
+            }
+        }
+        if (fclose(out) != 0) {
+            cerr << "error writing " << filename << endl;
+            exit(1);
+        }
+    }
+    // true if sequence matches the bases of contig from start on
+    bool check(int contig, long long start, const string& sequence) const {
+        for (size_t i = 0; i < sequence.size(); ++i) {
+            if (sequence[i] != base(contig, start + i)) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+struct BenchRegion {
+    int contig;
+    long long start;
+    long long length;
+};
+
+// one line of output; fields are added as "key":value pairs
+class BenchResult {
+    public:
+        BenchResult(const string& benchmark) {
+            fields.precision(10);  // enough that counts and sizes print exactly
+            fields << "{\"benchmark\":\"" << benchmark << "\"";
+        }
+        BenchResult& add(const string& key, double value) {
+            fields << ",\"" << key << "\":" << value;
+            return *this;
+        }
+        BenchResult& add(const string& key, const string& value) {
+            fields << ",\"" << key << "\":\"" << value << "\"";
+            return *this;
+        }
+        // throughput of bytes processed in seconds
+        BenchResult& rate(double seconds, double bytes) {
+            add("seconds", seconds);
+            return add("mb_per_second", bytes / seconds / (1 << 20));
+        }
+        // the distribution of per-operation latencies, in microseconds
+        BenchResult& latencies(vector<double>& seconds) {
+            sort(seconds.begin(), seconds.end());
+            double pcts[] = { 50, 90, 99, 99.9 };
+            const char* names[] = { "p50_us", "p90_us", "p99_us", "p999_us" };
+            for (int i = 0; i < 4; ++i) {
+                size_t at = min(seconds.size() - 1, (size_t) (pcts[i] / 100 * seconds.size()));
+                add(names[i], seconds[at] * 1e6);
+            }
+            return add("max_us", seconds.back() * 1e6);
+        }
+        void print(void) {
+            cout << fields.str() << "}" << endl;
+        }
+    private:
+        ostringstream fields;
+};
+
+static bool failed = false;
+
+static void fail(const string& benchmark, const string& message) {
+    cerr << benchmark << ": " << message << endl;
+    failed = true;
+}
+
+// the fewest threads the concurrent region check runs on, whatever --threads says
+static const int minConcurrentThreads = 4;
+
+// regions of the --large contig start at or after this offset
+static const long long largeOffset = 1LL << 31;
+
+// generate a reference of one contig of length bases, index it, and fetch
+// regions past largeOffset from it with pread and mmap, checking each
+static void benchLargeOffsets(const SyntheticReference& synthetic, long long length, const string& filename,
+                              int regionCount, int regionSize, int threads) {
+    SyntheticReference large = synthetic;
+    large.contigs = 1;
+    large.length = length;
+    string largeFileName = filename + ".large.fa";
+    steady_clock::time_point start = steady_clock::now();
+    large.write(largeFileName);
+    struct stat fileInfo;
+    stat(largeFileName.c_str(), &fileInfo);
+    BenchResult("large_generate").add("length", length).add("bytes", fileInfo.st_size)
+        .rate(secondsSince(start), fileInfo.st_size).print();
+
+    FastaIndex index;
+    start = steady_clock::now();
+    index.indexReference(largeFileName, threads);
+    BenchResult("large_index_build").add("threads", threads)
+        .rate(secondsSince(start), fileInfo.st_size).print();
+    if (index.size() != 1 || index.layout(0).length != length) {
+        fail("large_index_build", "wrong length for " + large.name(0));
+    }
+    index.writeIndexFile(largeFileName + index.indexFileExtension());
+
+    mt19937_64 random(synthetic.seed);
+    vector<BenchRegion> regions(regionCount);
+    for (int i = 0; i < regionCount; ++i) {
+        regions[i].contig = 0;
+        regions[i].start = largeOffset + random() % (length - largeOffset - regionSize + 1);
+        regions[i].length = regionSize;
+    }
+    const char* modes[] = { "pread", "mmap" };
+    for (int m = 0; m < 2; ++m) {
+        FastaReference fr;
+        fr.open(largeFileName, m == 1);
+        vector<double> latencies(regionCount);
+        string sequence;
+        bool correct = true;
+        start = steady_clock::now();
+        for (int i = 0; i < regionCount; ++i) {
+            const BenchRegion& r = regions[i];
+            steady_clock::time_point t = steady_clock::now();
+            fr.getSubSequence((size_t) 0, r.start, r.length, sequence);
+            latencies[i] = secondsSince(t);
+            correct = correct && (long long) sequence.size() == r.length && large.check(0, r.start, sequence);
+        }
+        double seconds = secondsSince(start);
+        if (!correct) {
+            fail("large_offset_regions", "wrong sequence past offset 2^31");
+        }
+        BenchResult("large_offset_regions").add("mode", modes[m]).add("length", length)
+            .add("regions", regionCount).add("size", regionSize)
+            .add("regions_per_second", regionCount / seconds).latencies(latencies).print();
+    }
+    unlink(largeFileName.c_str());
+    unlink((largeFileName + index.indexFileExtension()).c_str());
+}
+
+void printSummary() {
+    cerr << "usage: fastabench [options]" << endl
+         << endl
+         << "options:" << endl
+         << "    -n, --contigs N      number of contigs (default 16)" << endl
+         << "    -l, --length N       bases per contig (default 2000000)" << endl
+         << "    -w, --width N        bases per line (default 60)" << endl
+         << "    -x, --crlf           end lines with CRLF" << endl
+         << "    -r, --regions N      random regions to fetch (default 100000)" << endl
+         << "    -s, --size N         bases per random region (default 100)" << endl
+         << "    -t, --threads N      threads for the parallel benchmarks (default: one per core;" << endl
+         << "                         the concurrent region check always uses at least 4)" << endl
+         << "    -o, --output FILE    where to write the reference (default /tmp/fastabench.fa)" << endl
+         << "    -S, --seed N         seed for the bases and regions (default 1)" << endl
+         << "    -L, --large N        also fetch regions past 2^31 from a contig of N bases (at" << endl
+         << "                         least 2^31), written next to the reference and then removed" << endl
+         << endl
+         << "Results are printed one JSON object per line.  The exit status is non-zero if" << endl
+         << "any fetched sequence was wrong, or differed between serial and concurrent reads." << endl;
+}
+
+int main(int argc, char** argv) {
+    SyntheticReference synthetic;
+    synthetic.seed = 1;
+    synthetic.contigs = 16;
+    synthetic.length = 2000000;
+    synthetic.lineWidth = 60;
+    synthetic.crlf = false;
+    int regionCount = 100000;
+    int regionSize = 100;
+    int threads = 0;
+    string filename = "/tmp/fastabench.fa";
+    long long largeLength = 0;
+
+    int c;
+    while (true) {
+        static struct option long_options[] =
+        {
+            {"help", no_argument, 0, 'h'},
+            {"contigs", required_argument, 0, 'n'},
+            {"length", required_argument, 0, 'l'},
+            {"width", required_argument, 0, 'w'},
+            {"crlf", no_argument, 0, 'x'},
+            {"regions", required_argument, 0, 'r'},
+            {"size", required_argument, 0, 's'},
+            {"threads", required_argument, 0, 't'},
+            {"output", required_argument, 0, 'o'},
+            {"seed", required_argument, 0, 'S'},
+            {"large", required_argument, 0, 'L'},
+            {0, 0, 0, 0}
+        };
+        int option_index = 0;
+        c = getopt_long(argc, argv, "hn:l:w:xr:s:t:o:S:L:", long_options, &option_index);
+        if (c == -1)
+            break;
+        switch (c) {
+        case 'n': synthetic.contigs = atoi(optarg); break;
+        case 'l': synthetic.length = strtoll(optarg, NULL, 10); break;
+        case 'w': synthetic.lineWidth = atoi(optarg); break;
+        case 'x': synthetic.crlf = true; break;
+        case 'r': regionCount = atoi(optarg); break;
+        case 's': regionSize = atoi(optarg); break;
+        case 't': threads = atoi(optarg); break;
+        case 'o': filename = optarg; break;
+        case 'S': synthetic.seed = strtoull(optarg, NULL, 10); break;
+        case 'L': largeLength = strtoll(optarg, NULL, 10); break;
+        case 'h':
+            printSummary();
+            exit(0);
+        default:
+            printSummary();
+            exit(1);
+        }
+    }
+    if (synthetic.contigs < 1 || synthetic.length < 1 || synthetic.lineWidth < 1
+        || regionCount < 1 || regionSize < 1 || regionSize > synthetic.length) {
+        cerr << "contigs, length, width, regions and size must be positive, and size at most length" << endl;
+        exit(1);
+    }
+    if (largeLength != 0 && largeLength < largeOffset + regionSize) {
+        cerr << "the --large contig must hold regions past 2^31, so be at least " << largeOffset + regionSize << endl;
+        exit(1);
+    }
+    if (threads < 1) {
+        threads = defaultThreadCount();
+    }
+    double bases = (double) synthetic.contigs * synthetic.length;
+
+    steady_clock::time_point start = steady_clock::now();
+    synthetic.write(filename);
+    struct stat fileInfo;
+    stat(filename.c_str(), &fileInfo);
+    BenchResult("generate")
+        .add("contigs", synthetic.contigs).add("length", synthetic.length)
+        .add("width", synthetic.lineWidth).add("line_ending", synthetic.crlf ? "crlf" : "lf")
+        .add("bytes", fileInfo.st_size).add("threads", threads)
+        .rate(secondsSince(start), fileInfo.st_size).print();
+
+    // index building, serial and parallel, and index loading
+    string indexFileName = filename + ".fai";
+    string binaryIndexFileName = filename + ".fai.bin";
+    int buildThreads[] = { 1, threads };
+    for (int i = 0; i < (threads > 1 ? 2 : 1); ++i) {
+        FastaIndex index;
+        start = steady_clock::now();
+        index.indexReference(filename, buildThreads[i]);
+        BenchResult("index_build").add("threads", buildThreads[i])
+            .rate(secondsSince(start), fileInfo.st_size).print();
+        if (i == 0) {
+            index.writeIndexFile(indexFileName);
+            unlink(binaryIndexFileName.c_str());
+            if (!index.writeBinaryIndexFile(binaryIndexFileName, fileInfo)) {
+                fail("index_build", "could not write " + binaryIndexFileName);
+            }
+        }
+    }
+    {
+        FastaIndex index;
+        start = steady_clock::now();
+        index.readIndexFile(indexFileName);
+        BenchResult("index_load").add("format", "fai").add("seconds", secondsSince(start)).print();
+    }
+    {
+        FastaIndex index;
+        start = steady_clock::now();
+        if (!index.readBinaryIndexFile(binaryIndexFileName, fileInfo)) {
+            fail("index_load", "could not read " + binaryIndexFileName);
+        }
+        BenchResult("index_load").add("format", "fai.bin").add("seconds", secondsSince(start)).print();
+    }
+
+    // the random regions, the same for every mode
+    mt19937_64 random(synthetic.seed);
+    vector<BenchRegion> regions(regionCount);
+    vector<FastaRegion> targets;
+    for (int i = 0; i < regionCount; ++i) {
+        BenchRegion& r = regions[i];
+        r.contig = random() % synthetic.contigs;
+        r.start = random() % (synthetic.length - regionSize + 1);
+        r.length = regionSize;
+        ostringstream region;
+        region << synthetic.name(r.contig) << ":" << r.start + 1 << "-" << r.start + r.length;
+        string spec = region.str();
+        targets.push_back(FastaRegion(spec));
+    }
+
+    const char* modes[] = { "pread", "mmap" };
+    for (int m = 0; m < 2; ++m) {
+        FastaReference fr;
+        start = steady_clock::now();
+        fr.open(filename, m == 1);
+        BenchResult("open").add("mode", modes[m]).add("seconds", secondsSince(start)).print();
+
+        // random access, timing each fetch; the results are kept to compare
+        // with the concurrent fetches below
+        vector<string> serial(regionCount);
+        vector<double> latencies(regionCount);
+        start = steady_clock::now();
+        for (int i = 0; i < regionCount; ++i) {
+            const BenchRegion& r = regions[i];
+            steady_clock::time_point t = steady_clock::now();
+            fr.getSubSequence((size_t) r.contig, r.start, r.length, serial[i]);
+            latencies[i] = secondsSince(t);
+        }
+        double seconds = secondsSince(start);
+        for (int i = 0; i < regionCount; ++i) {
+            if ((long long) serial[i].size() != regions[i].length
+                || !synthetic.check(regions[i].contig, regions[i].start, serial[i])) {
+                fail("random_regions", "wrong sequence for " + targets[i].startSeq);
+                break;
+            }
+        }
+        BenchResult("random_regions").add("mode", modes[m]).add("regions", regionCount)
+            .add("size", regionSize).add("regions_per_second", regionCount / seconds)
+            .latencies(latencies).print();
+
+        // the same regions fetched from many threads sharing the reference.
+        // this is the check that a shared reference is thread-safe, so it
+        // always runs on several threads, even on a single core
+        int concurrentThreads = regionCount < 2 ? 1 : min(max(threads, minConcurrentThreads), regionCount);
+        vector<string> concurrent(regionCount);
+        start = steady_clock::now();
+        parallelFor(regionCount, concurrentThreads, [&](size_t i) {
+            fr.getSubSequence((size_t) regions[i].contig, regions[i].start, regions[i].length, concurrent[i]);
+        });
+        seconds = secondsSince(start);
+        if (concurrent != serial) {
+            fail("concurrent_regions", "sequences differ from serial reads");
+        }
+        BenchResult("concurrent_regions").add("mode", modes[m]).add("threads", concurrentThreads)
+            .add("regions_per_second", regionCount / seconds)
+            .add("consistent", concurrent == serial ? "yes" : "no").print();
+
+        // and as batches in file order
+        vector<string> batched;
+        start = steady_clock::now();
+        fr.getTargetSubSequences(targets, batched, threads);
+        seconds = secondsSince(start);
+        if (batched != serial) {
+            fail("batched_regions", "sequences differ from serial reads");
+        }
+        BenchResult("batched_regions").add("mode", modes[m]).add("threads", threads)
+            .add("regions_per_second", regionCount / seconds)
+            .add("consistent", batched == serial ? "yes" : "no").print();
+
+        // a sequential scan in fixed-size chunks
+        const int chunk = 1 << 16;
+        vector<char> buffer(chunk);
+        start = steady_clock::now();
+        for (int c = 0; c < synthetic.contigs; ++c) {
+            for (long long pos = 0; pos < synthetic.length; pos += chunk) {
+                fr.getSubSequence((size_t) c, pos, chunk, &buffer[0]);
+            }
+        }
+        BenchResult("sequential_scan").add("mode", modes[m]).add("chunk", chunk)
+            .rate(secondsSince(start), bases).print();
+
+        // the same through a cursor, with and without readahead, checking
+        // the bases after a seek to a random place in each contig
+        for (int readahead = 0; readahead < 2; ++readahead) {
+            bool correct = true;
+            start = steady_clock::now();
+            for (int c = 0; c < synthetic.contigs; ++c) {
+                FastaCursor cursor(fr, c, 0, synthetic.length, chunk, readahead);
+                while (cursor.next()) {
+                }
+                long long pos = random() % synthetic.length;
+                cursor.seek(pos);
+                correct = correct && cursor.next() && cursor.position() == pos
+                    && synthetic.check(c, pos, string(cursor.data(), cursor.size()));
+            }
+            if (!correct) {
+                fail("cursor_scan", "wrong sequence after a seek");
+            }
+            BenchResult("cursor_scan").add("mode", modes[m]).add("chunk", chunk)
+                .add("readahead", readahead ? "yes" : "no").rate(secondsSince(start), bases).print();
+        }
+
+        // whole sequences, checking each
+        string sequence;
+        start = steady_clock::now();
+        for (int c = 0; c < synthetic.contigs; ++c) {
+            fr.getSequence((size_t) c, sequence);
+        }
+        seconds = secondsSince(start);
+        int last = synthetic.contigs - 1;
+        if ((long long) sequence.size() != synthetic.length || !synthetic.check(last, 0, sequence)) {
+            fail("whole_sequence", "wrong sequence for " + synthetic.name(last));
+        }
+        BenchResult("whole_sequence").add("mode", modes[m])
+            .rate(seconds, bases).print();
+    }
+
+    if (largeLength != 0) {
+        benchLargeOffsets(synthetic, largeLength, filename, regionCount, regionSize, threads);
+    }
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,210 @@
+#include "Bgzf.h"
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// the largest a block can be, compressed or not
+static const int bgzfMaxBlockSize = 1 << 16;
+// the fixed part of the gzip header, before the extra field
+static const int bgzfHeaderSize = 12;
+// the gzip trailer: crc32 and uncompressed size
+static const int bgzfFooterSize = 8;
+
+static uint16_t readLE16(const unsigned char* p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t readLE32(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t readLE64(const unsigned char* p) {
+    return readLE32(p) | ((uint64_t) readLE32(p + 4) << 32);
+}
+
+static void writeLE64(unsigned char* p, uint64_t v) {
+    for (int i = 0; i < 8; ++i) {
+        p[i] = (v >> (8 * i)) & 0xff;
+    }
+}
+
+static long long preadAll(int fd, char* buffer, long long bytes, long long offset) {
+    long long done = 0;
+    while (done < bytes) {
+        ssize_t got = pread(fd, buffer + done, bytes - done, offset + done);
+        if (got <= 0) {
+            break;
+        }
+        done += got;
+    }
+    return done;
+}
+
+// the total size of the block whose header is at h, or 0 if h does not hold
+// a BGZF block header; bytes is how much of the header is available
+static int blockSize(const unsigned char* h, long long bytes) {
+    if (bytes < bgzfHeaderSize || h[0] != 31 || h[1] != 139 || h[2] != 8 || !(h[3] & 4)) {
+        return 0;
+    }
+    int xlen = readLE16(h + 10);
+    if (bytes < bgzfHeaderSize + xlen) {
+        return 0;
+    }
+    // look for the BC subfield, which holds the block size less one
+    for (const unsigned char* f = h + bgzfHeaderSize; f + 4 <= h + bgzfHeaderSize + xlen; f += 4 + readLE16(f + 2)) {
+        if (f[0] == 'B' && f[1] == 'C' && readLE16(f + 2) == 2) {
+            return readLE16(f + 4) + 1;
+        }
+    }
+    return 0;
+}
+
+BgzfFile::BgzfFile(void)
+    : fd(-1)
+    , cache(1 << 24, bgzfMaxBlockSize)
+{}
+
+BgzfFile::~BgzfFile(void) {
+    if (fd != -1)
+        close(fd);
+}
+
+bool BgzfFile::isGzip(const string& filename) {
+    unsigned char h[2];
+    ifstream in(filename.c_str(), ios::binary);
+    return in.read((char*) h, 2) && h[0] == 31 && h[1] == 139;
+}
+
+bool BgzfFile::isBgzf(const string& filename) {
+    unsigned char h[bgzfHeaderSize + 6];
+    ifstream in(filename.c_str(), ios::binary);
+    return in.read((char*) h, sizeof(h)) && blockSize(h, sizeof(h)) > 0;
+}
+
+void BgzfFile::open(const string& fname) {
+    filename = fname;
+    if ((fd = ::open(filename.c_str(), O_RDONLY)) == -1) {
+        cerr << "could not open " << filename << endl;
+        exit(1);
+    }
+}
+
+string BgzfFile::indexFileExtension() { return ".gzi"; }
+
+void BgzfFile::buildIndex(void) {
+    compressedOffsets.clear();
+    uncompressedOffsets.clear();
+    long long coffset = 0;
+    long long uoffset = 0;
+    unsigned char h[bgzfHeaderSize + 256];
+    long long got;
+    while ((got = preadAll(fd, (char*) h, sizeof(h), coffset)) > 0) {
+        int size = blockSize(h, got);
+        unsigned char isize[4];
+        if (size == 0 || preadAll(fd, (char*) isize, 4, coffset + size - 4) != 4) {
+            cerr << "malformed BGZF block at offset " << coffset << " of " << filename << endl;
+            exit(1);
+        }
+        compressedOffsets.push_back(coffset);
+        uncompressedOffsets.push_back(uoffset);
+        coffset += size;
+        uoffset += readLE32(isize);
+    }
+}
+
+void BgzfFile::readIndexFile(const string& fname) {
+    ifstream in(fname.c_str(), ios::binary);
+    unsigned char buffer[16];
+    if (!in.read((char*) buffer, 8)) {
+        cerr << "could not read BGZF index file " << fname << endl;
+        exit(1);
+    }
+    uint64_t count = readLE64(buffer);
+    compressedOffsets.assign(1, 0);
+    uncompressedOffsets.assign(1, 0);
+    for (uint64_t i = 0; i < count; ++i) {
+        if (!in.read((char*) buffer, 16)) {
+            cerr << "BGZF index file " << fname << " is truncated" << endl;
+            exit(1);
+        }
+        compressedOffsets.push_back(readLE64(buffer));
+        uncompressedOffsets.push_back(readLE64(buffer + 8));
+    }
+}
+
+void BgzfFile::writeIndexFile(const string& fname) {
+    ofstream out(fname.c_str(), ios::binary);
+    if (!out.is_open()) {
+        cerr << "could not open index file " << fname << " for writing!" << endl;
+        exit(1);
+    }
+    // the first block always starts at 0, 0, so it isn't written
+    unsigned char buffer[16];
+    writeLE64(buffer, compressedOffsets.empty() ? 0 : compressedOffsets.size() - 1);
+    out.write((char*) buffer, 8);
+    for (size_t i = 1; i < compressedOffsets.size(); ++i) {
+        writeLE64(buffer, compressedOffsets[i]);
+        writeLE64(buffer + 8, uncompressedOffsets[i]);
+        out.write((char*) buffer, 16);
+    }
+}
+
+// the decompressed contents of block i, from the cache if possible
+shared_ptr<const string> BgzfFile::block(size_t i) {
+    shared_ptr<const string> data = cache.get(0, i);
+    if (data) {
+        return data;
+    }
+    vector<unsigned char> compressed(bgzfMaxBlockSize);
+    long long got = preadAll(fd, (char*) &compressed[0], compressed.size(), compressedOffsets[i]);
+    int size = blockSize(&compressed[0], got);
+    if (size == 0 || size > got) {
+        cerr << "malformed BGZF block at offset " << compressedOffsets[i] << " of " << filename << endl;
+        exit(1);
+    }
+    int header = bgzfHeaderSize + readLE16(&compressed[10]);
+    string* bases = new string(readLE32(&compressed[size - 4]), '\0');
+    data.reset(bases);
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    zs.next_in = &compressed[header];
+    zs.avail_in = size - header - bgzfFooterSize;
+    zs.next_out = (Bytef*) &(*bases)[0];
+    zs.avail_out = bases->size();
+    int status = inflateInit2(&zs, -15);  // raw deflate, as the gzip wrapper is handled here
+    if (status == Z_OK) {
+        status = inflate(&zs, Z_FINISH);
+        inflateEnd(&zs);
+    }
+    if (status != Z_STREAM_END || zs.total_out != bases->size()) {
+        cerr << "could not decompress BGZF block at offset " << compressedOffsets[i] << " of " << filename << endl;
+        exit(1);
+    }
+    cache.put(0, i, data);
+    return data;
+}
+
+long long BgzfFile::read(char* buffer, long long bytes, long long offset) {
+    if (uncompressedOffsets.empty()) {
+        return 0;
+    }
+    size_t i = upper_bound(uncompressedOffsets.begin(), uncompressedOffsets.end(), offset)
+        - uncompressedOffsets.begin() - 1;
+    long long done = 0;
+    for (; done < bytes && i < compressedOffsets.size(); ++i) {
+        shared_ptr<const string> data = block(i);
+        long long from = offset + done - uncompressedOffsets[i];
+        if (from < (long long) data->size()) {
+            long long n = min(bytes - done, (long long) data->size() - from);
+            memcpy(buffer + done, data->data() + from, n);
+            done += n;
+        }
+    }
+    return done;
+}
@@ -0,0 +1,46 @@
+#ifndef FASTA_BGZF_H
+#define FASTA_BGZF_H
+
+// Random access into BGZF (bgzip) compressed files, as produced by bgzip and
+// used by samtools faidx.  A BGZF file is a series of gzip members ("blocks")
+// of at most 64kb each; the .gzi index records where every block starts in
+// the compressed and the uncompressed data, so a read at any uncompressed
+// offset only needs to decompress the blocks it touches.
+
+#include <string>
+#include <vector>
+#include <memory>
+#include "BlockCache.h"
+
+using namespace std;
+
+class BgzfFile {
+    public:
+        BgzfFile(void);
+        ~BgzfFile(void);
+        // true if the file starts with a gzip header of any kind
+        static bool isGzip(const string& filename);
+        // true if the file starts with a BGZF block header
+        static bool isBgzf(const string& filename);
+        void open(const string& filename);
+        // find the blocks by walking their headers; nothing is decompressed
+        void buildIndex(void);
+        // the .gzi format of samtools: a little-endian uint64 count, then
+        // that many pairs of uint64 compressed and uncompressed offsets, one
+        // for every block but the first
+        void readIndexFile(const string& fname);
+        void writeIndexFile(const string& fname);
+        string indexFileExtension(void);
+        // read up to bytes of uncompressed data starting at offset; returns
+        // the number of bytes read.  safe to call from many threads.
+        long long read(char* buffer, long long bytes, long long offset);
+        string filename;
+        int fd;
+        vector<long long> compressedOffsets;    // start of each block in the file
+        vector<long long> uncompressedOffsets;  // and in the uncompressed data
+        FastaBlockCache cache;  // recently decompressed blocks
+    private:
+        shared_ptr<const string> block(size_t i);
+};
+
+#endif
@@ -0,0 +1,46 @@
+#include "BlockCache.h"
+#include <algorithm>
+
+FastaBlockCache::FastaBlockCache(size_t capacity, int blockSize)
+    : blockSize(blockSize)
+    , capacity(max(capacity, (size_t) blockSize))
+    , bytes(0)
+    , hitCount(0)
+    , missCount(0)
+{}
+
+shared_ptr<const string> FastaBlockCache::get(long long sequence, long long block) {
+    FastaBlockKey key = { sequence, block };
+    lock_guard<mutex> guard(lock);
+    unordered_map<FastaBlockKey, BlockList::iterator, FastaBlockKeyHash>::iterator b = lookup.find(key);
+    if (b == lookup.end()) {
+        ++missCount;
+        return shared_ptr<const string>();
+    }
+    ++hitCount;
+    blocks.splice(blocks.begin(), blocks, b->second);
+    return b->second->second;
+}
+
+void FastaBlockCache::put(long long sequence, long long block, shared_ptr<const string> bases) {
+    FastaBlockKey key = { sequence, block };
+    lock_guard<mutex> guard(lock);
+    if (lookup.find(key) != lookup.end()) {
+        return;  // another thread read the same block in the meantime
+    }
+    blocks.push_front(make_pair(key, bases));
+    lookup[key] = blocks.begin();
+    bytes += bases->size();
+    while (bytes > capacity && !blocks.empty()) {
+        bytes -= blocks.back().second->size();
+        lookup.erase(blocks.back().first);
+        blocks.pop_back();
+    }
+}
+
+void FastaBlockCache::clear(void) {
+    lock_guard<mutex> guard(lock);
+    blocks.clear();
+    lookup.clear();
+    bytes = 0;
+}
@@ -0,0 +1,57 @@
+#ifndef FASTA_BLOCKCACHE_H
+#define FASTA_BLOCKCACHE_H
+
+// A size-bounded LRU cache of decoded sequence blocks: fixed-size runs of
+// bases, with line endings already removed, keyed by sequence and block
+// number.  Safe to share between threads.
+
+#include <string>
+#include <list>
+#include <utility>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <stddef.h>
+
+using namespace std;
+
+struct FastaBlockKey {
+    long long sequence;  // any value unique to the sequence, e.g. its file offset
+    long long block;     // block number within the sequence
+    bool operator==(const FastaBlockKey& other) const {
+        return sequence == other.sequence && block == other.block;
+    }
+};
+
+struct FastaBlockKeyHash {
+    size_t operator()(const FastaBlockKey& key) const {
+        return hash<long long>()(key.sequence * 1000003LL ^ key.block);
+    }
+};
+
+class FastaBlockCache {
+    public:
+        // hold up to capacity bytes of blocks of blockSize bases each; a
+        // capacity below one block is rounded up to it, as nothing could be kept
+        FastaBlockCache(size_t capacity, int blockSize = 1 << 14);
+        // the cached bases of a block, or an empty pointer on a miss
+        shared_ptr<const string> get(long long sequence, long long block);
+        // add a block, evicting the least recently used ones to make room
+        void put(long long sequence, long long block, shared_ptr<const string> bases);
+        void clear(void);
+        int blockSize;
+        size_t capacity;
+        unsigned long long hits(void) const { return hitCount; }
+        unsigned long long misses(void) const { return missCount; }
+    private:
+        typedef list<pair<FastaBlockKey, shared_ptr<const string> > > BlockList;
+        BlockList blocks;  // most recently used first
+        unordered_map<FastaBlockKey, BlockList::iterator, FastaBlockKeyHash> lookup;
+        size_t bytes;
+        mutex lock;
+        atomic<unsigned long long> hitCount;
+        atomic<unsigned long long> missCount;
+};
+
+#endif
@@ -7,14 +7,31 @@
 // ---------------------------------------------------------------------------
 
 #include "Fasta.h"
+#include "Parallel.h"
+#include <zlib.h>
+#include <fcntl.h>
+#include <sstream>
+#include <fnmatch.h>
+#include <limits.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
-FastaIndexEntry::FastaIndexEntry(string name, int length, long long offset, int line_blen, int line_len)
+FastaIndexEntry::FastaIndexEntry(string name, long long length, long long offset, long long line_blen, long long line_len,
+                                 long long qual_offset)
     : name(name)
-    , length(length)
-    , offset(offset)
-    , line_blen(line_blen)
-    , line_len(line_len)
-{}
+{
+    this->length = length;
+    this->offset = offset;
+    this->line_blen = line_blen;
+    this->line_len = line_len;
+    this->qual_offset = qual_offset;
+    segment = 0;
+    segment_count = 0;
+}
 
 FastaIndexEntry::FastaIndexEntry(void) // empty constructor
 { clear(); }
@@ -30,37 +47,261 @@ void FastaIndexEntry::clear(void)
                   // check if we have already recorded a real offset
     line_blen = 0;
     line_len = 0;
+    qual_offset = -1;
+    segment = 0;
+    segment_count = 0;
+    segments.clear();
 }
 
 ostream& operator<<(ostream& output, const FastaIndexEntry& e) {
     // just write the first component of the name, for compliance with other tools
     output << split(e.name, ' ').at(0) << "\t" << e.length << "\t" << e.offset << "\t" <<
         e.line_blen << "\t" << e.line_len;
+    if (e.qual_offset != -1) {
+        output << "\t" << e.qual_offset;  // fastq, as written by samtools fqidx
+    }
     return output;  // for multiple << operators.
 }
 
 FastaIndex::FastaIndex(void) 
-{}
+    : sorted(NULL)
+    , namesSorted(false)
+    , mapping(NULL)
+    , mappingSize(0)
+{
+    nameStartStore.push_back(0);
+    useStore();
+}
+
+// point the arrays in use at the storage owned by the index
+void FastaIndex::useStore(void) {
+    layouts = layoutStore.data();
+    names = nameStore.data();
+    nameStarts = nameStartStore.data();
+    slots = slotStore.data();
+    segments = segmentStore.data();
+    count = layoutStore.size();
+    slotCount = slotStore.size();
+    segmentCount = segmentStore.size();
+}
+
+// copy a mapped binary index into storage owned by the index, so it can be
+// added to, and drop the mapping
+void FastaIndex::unmap(void) {
+    if (mapping == NULL) {
+        return;
+    }
+    layoutStore.assign(layouts, layouts + count);
+    nameStore.assign(names, nameStarts[count]);
+    nameStartStore.assign(nameStarts, nameStarts + count + 1);
+    slotStore.assign(slots, slots + slotCount);
+    segmentStore.assign(segments, segments + segmentCount);
+    sortedStore.assign(sorted, sorted + count);
+    sorted = sortedStore.data();
+    munmap(mapping, mappingSize);
+    mapping = NULL;
+    mappingSize = 0;
+    useStore();
+}
+
+// FNV-1a, which is quick on the short names sequences have.  the binary index
+// stores the hash table, so this must not change without changing its version
+static uint64_t hashName(const char* name, size_t length) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; ++i) {
+        h = (h ^ (unsigned char) name[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// the slot holding the named sequence, or the empty slot where it would go
+size_t FastaIndex::slot(const char* name, size_t length) const {
+    size_t mask = slotCount - 1;
+    for (size_t i = hashName(name, length) & mask; ; i = (i + 1) & mask) {
+        uint32_t id = slots[i];
+        if (id == 0 || (nameStarts[id] - nameStarts[id - 1] == length
+                        && memcmp(&names[nameStarts[id - 1]], name, length) == 0)) {
+            return i;
+        }
+    }
+}
+
+void FastaIndex::rehash(size_t size) {
+    slotStore.assign(size, 0);
+    useStore();
+    for (size_t id = 0; id < count; ++id) {
+        size_t i = slot(&names[nameStarts[id]], nameStarts[id + 1] - nameStarts[id]);
+        if (slotStore[i] == 0) {  // the first of any duplicate names wins
+            slotStore[i] = id + 1;
+        }
+    }
+}
+
+void FastaIndex::flushEntryToIndex(FastaIndexEntry& entry) {
+    vector<string> tokens = split(entry.name, " \t");  // key by first token of name
+    const string& name = tokens.at(0);
+    unmap();
+    FastaLayout layout = entry;
+    layout.segment = 0;
+    layout.segment_count = 0;
+    if (entry.segments.size() > 1) {
+        layout.segment = segmentStore.size();
+        layout.segment_count = entry.segments.size();
+        segmentStore.insert(segmentStore.end(), entry.segments.begin(), entry.segments.end());
+    }
+    namesSorted = false;
+    layoutStore.push_back(layout);
+    nameStore.append(name);
+    nameStartStore.push_back(nameStore.size());
+    useStore();
+    // keep the table at most half full
+    if (slotCount < 2 * count) {
+        rehash(max((size_t) 1024, slotCount * 2));
+    } else {
+        size_t i = slot(name.data(), name.size());
+        if (slotStore[i] == 0) {
+            slotStore[i] = count;
+        }
+    }
+}
+
+long long FastaIndex::sequenceID(const string& name) const {
+    if (slotCount == 0) {
+        return -1;
+    }
+    return (long long) slots[slot(name.data(), name.size())] - 1;
+}
+
+string FastaIndex::sequenceName(size_t id) const {
+    return string(names + nameStarts[id], nameStarts[id + 1] - nameStarts[id]);
+}
+
+void FastaIndex::sortNames(void) const {
+    lock_guard<mutex> hold(sortLock);
+    if (namesSorted) {
+        return;
+    }
+    sortedStore.resize(count);
+    for (size_t id = 0; id < count; ++id) {
+        sortedStore[id] = id;
+    }
+    // by the bytes of the name, then by id for any duplicate names
+    sort(sortedStore.begin(), sortedStore.end(), [this](uint32_t a, uint32_t b) {
+        size_t aLength = nameStarts[a + 1] - nameStarts[a];
+        size_t bLength = nameStarts[b + 1] - nameStarts[b];
+        int c = memcmp(names + nameStarts[a], names + nameStarts[b], min(aLength, bLength));
+        if (c != 0) {
+            return c < 0;
+        }
+        return aLength != bLength ? aLength < bLength : a < b;
+    });
+    sorted = sortedStore.data();
+    namesSorted = true;
+}
+
+void FastaIndex::sequencesStartingWith(const string& prefix, vector<size_t>& ids) const {
+    ids.clear();
+    if (!namesSorted) {
+        sortNames();
+    }
+    // the first name not less than prefix, then every name after it that
+    // starts with it
+    const uint32_t* first = lower_bound(sorted, sorted + count, prefix, [this](uint32_t id, const string& prefix) {
+        size_t length = nameStarts[id + 1] - nameStarts[id];
+        int c = memcmp(names + nameStarts[id], prefix.data(), min(length, prefix.size()));
+        return c != 0 ? c < 0 : length < prefix.size();
+    });
+    for (const uint32_t* i = first; i < sorted + count; ++i) {
+        size_t length = nameStarts[*i + 1] - nameStarts[*i];
+        if (length < prefix.size() || memcmp(names + nameStarts[*i], prefix.data(), prefix.size()) != 0) {
+            break;
+        }
+        ids.push_back(*i);
+    }
+}
+
+void FastaIndex::sequencesMatching(const string& pattern, vector<size_t>& ids) const {
+    vector<size_t> candidates;
+    sequencesStartingWith(pattern.substr(0, pattern.find_first_of("*?[\\")), candidates);
+    ids.clear();
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        if (fnmatch(pattern.c_str(), sequenceName(candidates[i]).c_str(), 0) == 0) {
+            ids.push_back(candidates[i]);
+        }
+    }
+}
+
+FastaIndexEntry FastaIndex::entry(size_t id) const {
+    const FastaLayout& l = layouts[id];
+    FastaIndexEntry e(sequenceName(id), l.length, l.offset, l.line_blen, l.line_len, l.qual_offset);
+    e.segments.assign(segments + l.segment, segments + l.segment + l.segment_count);
+    return e;
+}
+
+static bool fastaSegmentStartCompare(long long pos, const FastaSegment& segment) {
+    return pos < segment.start;
+}
+
+FastaLayout FastaIndex::segmentLayout(const FastaLayout& entry, long long pos, long long& segmentStart) const {
+    if (entry.segment_count == 0) {
+        segmentStart = 0;
+        return entry;
+    }
+    const FastaSegment* first = segments + entry.segment;
+    const FastaSegment* last = first + entry.segment_count;
+    const FastaSegment* s = upper_bound(first, last, pos, fastaSegmentStartCompare) - 1;
+    FastaLayout part = entry;
+    part.offset = s->offset;
+    part.length = (s + 1 < last ? (s + 1)->start : entry.length) - s->start;
+    part.line_blen = s->line_blen;
+    part.line_len = s->line_len;
+    part.segment_count = 0;
+    segmentStart = s->start;
+    return part;
+}
+
+FastaIndexEntry FastaIndex::entry(const string& name) const {
+    long long id = sequenceID(name);
+    if (id == -1) {
+        cerr << "unable to find FASTA index entry for '" << name << "'" << endl;
+        exit(1);
+    }
+    return entry(id);
+}
 
 void FastaIndex::readIndexFile(string fname) {
     string line;
     long long linenum = 0;
+    ifstream indexFile;
     indexFile.open(fname.c_str(), ifstream::in);
     if (indexFile.is_open()) {
+        FastaIndexEntry entry;  // held back until any segment lines after it are read
         while (getline (indexFile, line)) {
             ++linenum;
             // the fai format defined in samtools is tab-delimited, every line being:
             // fai->name[i], (int)x.len, (long long)x.offset, (int)x.line_blen, (int)x.line_len
+            // (read here as 64-bit numbers, for sequences of 2^31 bases or more)
+            // with a sixth field, (long long)x.qual_offset, in the index of a fastq file
             vector<string> fields = split(line, '\t');
-            if (fields.size() == 5) {  // if we don't get enough fields then there is a problem with the file
+            char* end;
+            if (fields.size() == 5 && fields[0].empty() && !entry.name.empty()) {
+                // a segment of the last sequence, in a .fxi
+                FastaSegment segment;
+                segment.start = strtoll(fields[1].c_str(), &end, 10);
+                segment.offset = strtoll(fields[2].c_str(), &end, 10);
+                segment.line_blen = strtoll(fields[3].c_str(), &end, 10);
+                segment.line_len = strtoll(fields[4].c_str(), &end, 10);
+                entry.segments.push_back(segment);
+            } else if ((fields.size() == 5 || fields.size() == 6) && !fields[0].empty()) {  // if we don't get enough fields then there is a problem with the file
                 // note that fields[0] is the sequence name
-                char* end;
-                string name = split(fields[0], " \t").at(0);  // key by first token of name
-                sequenceNames.push_back(name);
-                this->insert(make_pair(name, FastaIndexEntry(fields[0], atoi(fields[1].c_str()),
-                                                    strtoll(fields[2].c_str(), &end, 10),
-                                                    atoi(fields[3].c_str()),
-                                                    atoi(fields[4].c_str()))));
+                if (!entry.name.empty()) {
+                    flushEntryToIndex(entry);
+                }
+                entry = FastaIndexEntry(fields[0], strtoll(fields[1].c_str(), &end, 10),
+                                        strtoll(fields[2].c_str(), &end, 10),
+                                        strtoll(fields[3].c_str(), &end, 10),
+                                        strtoll(fields[4].c_str(), &end, 10),
+                                        fields.size() == 6 ? strtoll(fields[5].c_str(), &end, 10) : -1);
             } else {
                 cerr << "Warning: malformed fasta index file " << fname << 
                     "does not have enough fields @ line " << linenum << endl;
@@ -68,148 +309,605 @@ void FastaIndex::readIndexFile(string fname) {
                 exit(1);
             }
         }
+        if (!entry.name.empty()) {
+            flushEntryToIndex(entry);
+        }
     } else {
         cerr << "could not open index file " << fname << endl;
         exit(1);
     }
 }
 
-// for consistency this should be a class method
-bool fastaIndexEntryCompare ( FastaIndexEntry a, FastaIndexEntry b) { return (a.offset<b.offset); }
+// orders sequence ids by their offset in the file
+struct FastaIndexOffsetCompare {
+    const FastaIndex& index;
+    FastaIndexOffsetCompare(const FastaIndex& index) : index(index) { }
+    bool operator()(size_t a, size_t b) const {
+        return index.layout(a).offset < index.layout(b).offset;
+    }
+};
 
 ostream& operator<<(ostream& output, FastaIndex& fastaIndex) {
-    vector<FastaIndexEntry> sortedIndex;
-    for(vector<string>::const_iterator it = fastaIndex.sequenceNames.begin(); it != fastaIndex.sequenceNames.end(); ++it)
-    {
-        sortedIndex.push_back(fastaIndex[*it]);
+    vector<size_t> sortedIndex(fastaIndex.size());
+    for (size_t id = 0; id < sortedIndex.size(); ++id) {
+        sortedIndex[id] = id;
     }
-    sort(sortedIndex.begin(), sortedIndex.end(), fastaIndexEntryCompare);
-    for( vector<FastaIndexEntry>::iterator fit = sortedIndex.begin(); fit != sortedIndex.end(); ++fit) {
-        output << *fit << endl;
+    stable_sort(sortedIndex.begin(), sortedIndex.end(), FastaIndexOffsetCompare(fastaIndex));
+    for (vector<size_t>::iterator id = sortedIndex.begin(); id != sortedIndex.end(); ++id) {
+        const FastaLayout& l = fastaIndex.layout(*id);
+        output.write(&fastaIndex.names[fastaIndex.nameStarts[*id]],
+                     fastaIndex.nameStarts[*id + 1] - fastaIndex.nameStarts[*id]);
+        output << "\t" << l.length << "\t" << l.offset << "\t" << l.line_blen << "\t" << l.line_len;
+        if (l.qual_offset != -1) {
+            output << "\t" << l.qual_offset;
+        }
+        output << '\n';
+        for (int i = 0; i < l.segment_count; ++i) {
+            const FastaSegment& s = fastaIndex.segments[l.segment + i];
+            output << "\t" << s.start << "\t" << s.offset << "\t" << s.line_blen << "\t" << s.line_len << '\n';
+        }
     }
     return output;
 }
 
-// Read a line from in into line. Line endings ('\r', '\n', etc.) are not
-// written to line but is counted in bytes, which will hold the total bytes
-// consumed. Supports both '\n' and '\r\n' line endings. Returns true if data
-// was read, and false on EOF before anything could be read.
-bool getlineCounting(istream& in, string& line, int& bytes) {
-    bytes = 0;
-    line.clear();
-    for(int got = in.get(); got != EOF; got = in.get()) {
-        bytes++;
-        if (got == '\n') {
-            // Line is over, but we read something (the '\n')
-            return true;
-        } else if (got != '\r') {
-            // Anything other than a '\r' is real data.
-            line.push_back((char)got);
+// The indexer works in two stages.  A scanner walks a block of the file with
+// memchr, classifies each line and hands it to a sink; the builder sink below
+// runs the same line-by-line checks the indexer always has and records the
+// entries.  Large files are cut into chunks at line boundaries (at read
+// boundaries, for fastq), each chunk is scanned on its own thread into a list
+// of runs of identical lines, and the runs are then replayed through a single builder in file order, so the
+// resulting index, and any error it raises, is the same as a serial scan.
+
+// files smaller than this are always indexed on a single thread
+static const long long parallelIndexMinBytes = 1 << 24;
+
+// the line length with any '\r' removed, which is how the data would read
+// with the line endings taken out
+static long long lineLength(const char* begin, const char* end) {
+    long long length = end - begin;
+    for (const char* r = (const char*) memchr(begin, '\r', end - begin); r != NULL;
+         r = (const char*) memchr(r + 1, '\r', end - r - 1)) {
+        --length;
+    }
+    return length;
+}
+
+// tracks the sequence currently being indexed and validates its line layout
+class FastaIndexBuilder {
+public:
+    // offset is where in the file scanning starts
+    FastaIndexBuilder(FastaIndex& index, long long offset = 0)
+        : index(index)
+        , offset(offset)
+        , line_number(0)
+        , mismatchedLineLengths(false)
+        , emptyLine(false)
+    { entry.clear(); }
+
+    // a fasta or fastq header line
+    void header(const string& name, long long bytes) {
+        ++line_number;
+        // if we aren't on the first entry, push the last sequence into the index
+        if (entry.name != "") {
+            index.flushEntryToIndex(entry);
+        }
+        // reset the line layout for every new sequence, which also drops any
+        // blank lines before the first header
+        entry.clear();
+        segment = FastaSegment();
+        mismatchedLineLengths = false;
+        emptyLine = false;
+        entry.name = name;
+        offset += bytes;
+    }
+
+    // lines which carry no sequence, such as fasta comments
+    void skip(long long bytes) {
+        ++line_number;
+        offset += bytes;
+    }
+
+    // a fastq quality header of headerBytes bytes and the quality line after
+    // it, with length qualities in bytes bytes all told.  the qualities are
+    // read back with the layout of the sequence, so they must match it.
+    void quality(long long headerBytes, long long length, long long bytes) {
+        if (length != entry.length || entry.line_blen != entry.length) {
+            if (length != entry.length) {
+                cerr << "ERROR: quality length " << length << " differs from sequence length " << entry.length;
+            } else {
+                cerr << "ERROR: sequence split over several lines";
+            }
+            cerr << " at line " << line_number + 1 << " within read " << entry.name <<
+                endl << "File not suitable for fastq index generation." << endl;
+            exit(1);
+        }
+        entry.qual_offset = offset + headerBytes;
+        line_number += 2;
+        offset += bytes;
+    }
+
+    // count consecutive sequence lines, each with length bases in bytes bytes
+    void sequence(long long length, long long bytes, long long count) {
+        line(length, bytes);
+        if (count > 1) {
+            line(length, bytes);
+        }
+        if (count > 2) {
+            // after two identical lines the line-length tracking can no
+            // longer change, so the rest of the run just adds up
+            entry.length += (count - 2) * length;
+            line_number += count - 2;
+            offset += (count - 2) * bytes;
+        }
+    }
+
+    // we've hit the end of the fasta file!
+    // flush the last entry
+    void finish(void) {
+        if (entry.name != "") {
+            index.flushEntryToIndex(entry);
+        }
+    }
+
+private:
+    void line(long long line_length, long long line_bytes) {
+        ++line_number;
+        if (entry.offset == -1) // NB initially the offset is -1
+            entry.offset = offset;
+        if (entry.line_len) {
+            if (emptyLine) {
+                if (line_length != 0) {
+                    cerr << "ERROR: embedded newline at line " << line_number << " within sequence " << entry.name <<
+                        endl << "File not suitable for fasta index generation." << endl;
+                    exit(1);
+                }
+            } else if (mismatchedLineLengths && line_length == 0) {
+                emptyLine = true; // flag empty lines, raise error only if this is embedded in the sequence
+            } else if (mismatchedLineLengths || line_length > segment.line_blen) {
+                // the line length has changed for good, as a line followed
+                // the last mismatched one, or it grew, which only a new
+                // segment can describe
+                startSegment(line_length, line_bytes);
+            } else if (segment.line_len != line_bytes) {
+                // this flag is set here and checked on the next line
+                // because we may have reached the end of the segment (or
+                // the sequence), where a shorter line is OK
+                mismatchedLineLengths = true;
+                if (line_length == 0) {
+                    emptyLine = true; // flag empty lines, raise error only if this is embedded in the sequence
+                }
+            }
+        } else {
+            entry.line_len = line_bytes; // first line
+            entry.line_blen = line_length;
+            segment.start = 0;
+            segment.offset = offset;
+            segment.line_blen = line_length;
+            segment.line_len = line_bytes;
         }
-        // '\r' is skipped, but still counted in bytes
+        entry.length += line_length;
+        offset += line_bytes;
+    }
+
+    // the lines from here on are laid out differently from those before
+    void startSegment(long long line_length, long long line_bytes) {
+        if (entry.segments.empty()) {
+            entry.segments.push_back(segment);
+        }
+        segment.start = entry.length;
+        segment.offset = offset;
+        segment.line_blen = line_length;
+        segment.line_len = line_bytes;
+        entry.segments.push_back(segment);
+        mismatchedLineLengths = false;
+    }
+
+    FastaIndex& index;
+    FastaIndexEntry entry;  // an entry buffer used in processing
+    FastaSegment segment;  // the layout of the lines of the current segment
+    long long offset;  // byte offset from start of file
+    long long line_number; // current line number
+    bool mismatchedLineLengths; // flag to indicate if our line length changes mid-file
+                                // this will be used to start a new
+                                // segment if we have a line length
+                                // change at any line other than the
+                                // last line in the sequence
+    bool emptyLine;  // flag to catch empty lines, which we allow for
+                     // index generation only on the last line of the sequence
+};
+
+// a run of lines as seen by a chunk scanner, to be replayed into a builder
+struct FastaLineRun {
+    char kind;  // '>' for a header, ';' for skipped lines, 's' for sequence, '+' for qualities
+    long long length;
+    long long bytes;
+    long long count;  // for qualities, the bytes of the quality header
+    string name;
+};
+
+// records the lines of one chunk so they can be replayed in order later
+class FastaLineRunCollector {
+public:
+    FastaLineRunCollector(void) : sawQuality(false) { }
+    vector<FastaLineRun> runs;
+    bool sawQuality;  // fastq quality lines can't be told apart from
+                      // sequence at an arbitrary chunk boundary
+    void header(const string& name, long long bytes) {
+        add('>', 0, bytes, 1).name = name;
+    }
+    void skip(long long bytes) {
+        add(';', 0, bytes, 1);
+    }
+    void quality(long long headerBytes, long long length, long long bytes) {
+        sawQuality = true;
+        add('+', length, bytes, headerBytes);
+    }
+    void sequence(long long length, long long bytes, long long count) {
+        if (!runs.empty() && runs.back().kind == 's'
+            && runs.back().length == length && runs.back().bytes == bytes) {
+            runs.back().count += count;
+        } else {
+            add('s', length, bytes, count);
+        }
+    }
+    void replay(FastaIndexBuilder& builder) {
+        for (vector<FastaLineRun>::iterator r = runs.begin(); r != runs.end(); ++r) {
+            switch (r->kind) {
+            case '>': builder.header(r->name, r->bytes); break;
+            case ';': builder.skip(r->bytes); break;
+            case '+': builder.quality(r->count, r->length, r->bytes); break;
+            default: builder.sequence(r->length, r->bytes, r->count); break;
+            }
+        }
+    }
+private:
+    FastaLineRun& add(char kind, long long length, long long bytes, long long count) {
+        FastaLineRun run;
+        run.kind = kind;
+        run.length = length;
+        run.bytes = bytes;
+        run.count = count;
+        runs.push_back(run);
+        return runs.back();
+    }
+};
+
+// Split [begin, end) into lines and pass them to sink.  Supports both '\n'
+// and '\r\n' line endings; '\r' is not counted as sequence but is counted in
+// bytes.  The last line may lack a newline only if atEof is set; otherwise
+// scanning stops before it (or before a fastq quality header whose quality
+// line is not yet complete).  Returns the position scanning stopped at.
+template <class Sink>
+static const char* scanLines(const char* begin, const char* end, bool atEof, Sink& sink) {
+    const char* p = begin;
+    while (p < end) {
+        const char* eol = (const char*) memchr(p, '\n', end - p);
+        if (eol == NULL && !atEof) {
+            break;
+        }
+        if (eol == NULL) {
+            eol = end;
+        }
+        const char* next = eol < end ? eol + 1 : end;
+        const char* first = p;
+        while (first < eol && *first == '\r') {
+            ++first;
+        }
+        char kind = first < eol ? *first : '\0';
+        if (kind == ';') {
+            // fasta comment, skip
+            sink.skip(next - p);
+        } else if (kind == '+') {
+            // fastq quality header; read in the quality line along with it,
+            // as a quality line may begin with any character
+            const char* qual_eol = next < end ? (const char*) memchr(next, '\n', end - next) : NULL;
+            if (qual_eol == NULL && !atEof) {
+                break;
+            }
+            if (qual_eol == NULL) {
+                qual_eol = end;
+            }
+            sink.quality(next - p, lineLength(next, qual_eol), (qual_eol < end ? qual_eol + 1 : end) - p);
+            next = qual_eol < end ? qual_eol + 1 : end;
+        } else if (kind == '>' || kind == '@') { // fasta /fastq header
+            string name;
+            for (const char* c = first + 1; c < eol; ++c) {
+                if (*c != '\r') {
+                    name.push_back(*c);
+                }
+            }
+            sink.header(name, next - p);
+        } else { // we assume we have found a sequence line
+            sink.sequence(lineLength(p, eol), next - p, 1);
+        }
+        p = next;
+    }
+    return p;
+}
+
+// true if the line starting at p, of which [p, end) has been read, is a
+// sequence line rather than a header, comment or quality header
+static bool isSequenceLine(const char* p, const char* end) {
+    while (p < end && *p == '\r') {
+        ++p;
+    }
+    return p == end || (*p != ';' && *p != '+' && *p != '>' && *p != '@');
+}
+
+// scan a stream that can't be mapped, a block at a time.  zlib passes
+// uncompressed data straight through, so this reads both plain streams and
+// (b)gzip-compressed files.  a sequence line longer than the buffer is counted
+// as it streams past, so lines of any length are indexed in fixed memory.
+template <class Sink>
+static void scanStream(gzFile in, Sink& sink) {
+    vector<char> buffer(1 << 22);
+    size_t filled = 0;
+    // the bases and bytes read so far of a sequence line that didn't fit
+    bool open = false;
+    long long openLength = 0;
+    long long openBytes = 0;
+    while (true) {
+        if (filled == buffer.size()) {
+            buffer.resize(buffer.size() * 2);  // a header or quality line longer than the buffer
+        }
+        // gzread takes an unsigned length and returns an int
+        long long got = gzread(in, &buffer[filled], (unsigned) min(buffer.size() - filled, (size_t) INT_MAX));
+        if (got < 0) {
+            int error;
+            cerr << "error reading fasta file: " << gzerror(in, &error) << endl;
+            exit(1);
+        }
+        filled += got;
+        const char* begin = &buffer[0];
+        const char* end = begin + filled;
+        if (open) {
+            const char* eol = (const char*) memchr(begin, '\n', filled);
+            if (eol == NULL && got != 0) {
+                openLength += lineLength(begin, end);
+                openBytes += filled;
+                filled = 0;
+                continue;
+            }
+            if (eol == NULL) {
+                eol = end;
+            }
+            const char* next = eol < end ? eol + 1 : end;
+            sink.sequence(openLength + lineLength(begin, eol), openBytes + (next - begin), 1);
+            open = false;
+            begin = next;
+        }
+        const char* done = scanLines(begin, end, got == 0, sink);
+        if (got == 0) {
+            break;
+        }
+        if (done == &buffer[0] && filled == buffer.size() && isSequenceLine(done, end)) {
+            // the buffer holds the start of a single sequence line
+            open = true;
+            openLength = lineLength(done, end);
+            openBytes = filled;
+            filled = 0;
+            continue;
+        }
+        size_t used = done - &buffer[0];
+        memmove(&buffer[0], &buffer[used], filled - used);
+        filled -= used;
+    }
+    gzclose(in);
+}
+
+// the start of the first fastq read at or after the line starting at p, or
+// NULL if none is found nearby.  a read is taken to be four lines: a header,
+// the sequence, a quality header and qualities as long as the sequence,
+// followed by the next header.  as no sequence line begins with '+', a
+// quality line that begins with '@' is never mistaken for the header.
+static const char* fastqRecordStart(const char* p, const char* end) {
+    static const int maxLines = 1 << 10;
+    for (int n = 0; n < maxLines && p < end; ++n) {
+        // the starts and ends of the next five lines
+        const char* begins[5];
+        const char* eols[5];
+        const char* q = p;
+        for (int i = 0; i < 5; ++i) {
+            const char* eol = q < end ? (const char*) memchr(q, '\n', end - q) : NULL;
+            begins[i] = q;
+            eols[i] = eol != NULL ? eol : end;
+            q = eol != NULL ? eol + 1 : end;
+        }
+        if (*begins[0] == '@' && begins[2] < end && *begins[2] == '+'
+            && (begins[4] == end || *begins[4] == '@')
+            && lineLength(begins[1], eols[1]) == lineLength(begins[3], eols[3])) {
+            return p;
+        }
+        p = begins[1];
+    }
+    return p == end ? end : NULL;
+}
+
+// scan [begin, end) of a mapped file into builder, on up to threads threads
+static void scanMapped(const char* begin, const char* end, int threads, FastaIndexBuilder& builder) {
+    long long size = end - begin;
+    if (threads < 1) {
+        threads = defaultThreadCount();
+    }
+    bool scanned = false;
+    if (threads > 1 && size >= parallelIndexMinBytes) {
+        // cut the file into one chunk per thread, each starting on a new
+        // line, or for fastq at the start of a read
+        bool fastq = *begin == '@';
+        vector<const char*> bounds;
+        bounds.push_back(begin);
+        for (int i = 1; i < threads && bounds.back() != NULL; ++i) {
+            const char* p = max(bounds.back(), begin + size / threads * i);
+            const char* eol = (const char*) memchr(p, '\n', end - p);
+            p = eol != NULL ? eol + 1 : end;
+            bounds.push_back(fastq ? fastqRecordStart(p, end) : p);
+        }
+        bounds.push_back(end);
+        // fastq has to be scanned in one pass if its reads could not be
+        // found, or if a chunk of what looked like fasta had quality lines,
+        // as a chunk may then start on a quality line that looks like a
+        // header or sequence
+        vector<FastaLineRunCollector> chunks(threads);
+        bool sawQuality = find(bounds.begin(), bounds.end(), (const char*) NULL) != bounds.end();
+        if (!sawQuality) {
+            parallelFor(threads, threads, [&](size_t i) {
+                scanLines(bounds[i], bounds[i + 1], true, chunks[i]);
+            });
+        }
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            sawQuality = sawQuality || (!fastq && chunks[i].sawQuality);
+        }
+        if (!sawQuality) {
+            for (size_t i = 0; i < chunks.size(); ++i) {
+                chunks[i].replay(builder);
+                vector<FastaLineRun>().swap(chunks[i].runs);
+            }
+            scanned = true;
+        }
+    }
+    if (!scanned) {
+        scanLines(begin, end, true, builder);
     }
-    return !line.empty();
 }
 
-void FastaIndex::indexReference(string refname) {
+void FastaIndex::indexReference(string refname, int threads) {
     // overview:
     //  for line in the reference fasta file
     //  track byte offset from the start of the file
     //  if line is a fasta header, take the name and dump the last sequnece to the index
     //  if line is a sequence, add it to the current sequence
     //cerr << "indexing fasta reference " << refname << endl;
-    string line;
-    FastaIndexEntry entry;  // an entry buffer used in processing
-    entry.clear();
-    int line_length = 0;
-    int line_bytes = 0;
-    long long offset = 0;  // byte offset from start of file
-    long long line_number = 0; // current line number
-    bool mismatchedLineLengths = false; // flag to indicate if our line length changes mid-file
-                                        // this will be used to raise an error
-                                        // if we have a line length change at
-                                        // any line other than the last line in
-                                        // the sequence
-    bool emptyLine = false;  // flag to catch empty lines, which we allow for
-                             // index generation only on the last line of the sequence
-    ifstream refFile;
-    refFile.open(refname.c_str());
-    if (refFile.is_open()) {
-        while (getlineCounting(refFile, line, line_bytes)) {
-            ++line_number;
-            line_length = line.length();
-            if (line[0] == ';') {
-                // fasta comment, skip
-            } else if (line[0] == '+') {
-                // fastq quality header
-                
-                // account for header offset
-                offset += line_bytes;
-                
-                // read in quality line so its offset will be accounted for too
-                // TODO: we don't support the quality offset field of the FAI format
-                getlineCounting(refFile, line, line_bytes);
-                line_length = line.length();
-            } else if (line[0] == '>' || line[0] == '@') { // fasta /fastq header
-                // if we aren't on the first entry, push the last sequence into the index
-                if (entry.name != "") {
-                    mismatchedLineLengths = false; // reset line length error tracker for every new sequence
-                    emptyLine = false;
-                    flushEntryToIndex(entry);
-                    entry.clear();
-                }
-                entry.name = line.substr(1, line_length - 1);
-            } else { // we assume we have found a sequence line
-                if (entry.offset == -1) // NB initially the offset is -1
-                    entry.offset = offset;
-                entry.length += line_length;
-                if (entry.line_len) {
-                    if (mismatchedLineLengths || emptyLine) {
-                        if (line_length == 0) {
-                            emptyLine = true; // flag empty lines, raise error only if this is embedded in the sequence
-                        } else {
-                            if (emptyLine) {
-                                cerr << "ERROR: embedded newline";
-                            } else {
-                                cerr << "ERROR: mismatched line lengths";
-                            }
-                            cerr << " at line " << line_number << " within sequence " << entry.name <<
-                                endl << "File not suitable for fasta index generation." << endl;
-                            exit(1);
-                        }
-                    }
-                    // this flag is set here and checked on the next line
-                    // because we may have reached the end of the sequence, in
-                    // which case a mismatched line length is OK
-                    if (entry.line_len != line_bytes) {
-                        mismatchedLineLengths = true;
-                        if (line_length == 0) {
-                            emptyLine = true; // flag empty lines, raise error only if this is embedded in the sequence
-                        }
-                    }
-                } else {
-                    entry.line_len = line_bytes; // first line
-                    entry.line_blen = line_length;
-                }
-            }
-            offset += line_bytes;
-        }
-        // we've hit the end of the fasta file!
-        // flush the last entry
-        flushEntryToIndex(entry);
-    } else {
+    FILE* refFile = fopen(refname.c_str(), "r");
+    if (refFile == NULL) {
         cerr << "could not open reference file " << refname << " for indexing!" << endl;
         exit(1);
     }
+    if (TwoBitFile::isTwoBit(refname)) {
+        cerr << refname << " is a 2bit file, which needs no index" << endl;
+        exit(1);
+    }
+    FastaIndexBuilder builder(*this);
+    struct stat stFileInfo;
+    bool compressed = BgzfFile::isGzip(refname);
+    if (compressed && !BgzfFile::isBgzf(refname)) {
+        cerr << "cannot index " << refname << ": it is compressed with gzip rather than bgzip" << endl;
+        exit(1);
+    }
+    // offsets in the index of a bgzip-compressed file are offsets into the
+    // uncompressed data, as with samtools
+    if (compressed || fstat(fileno(refFile), &stFileInfo) != 0 || !S_ISREG(stFileInfo.st_mode)) {
+        scanStream(gzdopen(dup(fileno(refFile)), "r"), builder);
+        builder.finish();
+        fclose(refFile);
+        return;
+    }
+    long long size = stFileInfo.st_size;
+    const char* data = NULL;
+    if (size > 0) {
+        void* mapped = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(refFile), 0);
+        if (mapped == MAP_FAILED) {
+            scanStream(gzdopen(dup(fileno(refFile)), "r"), builder);
+            builder.finish();
+            fclose(refFile);
+            return;
+        }
+        data = (const char*) mapped;
+        madvise(mapped, size, MADV_SEQUENTIAL);
+    }
+    scanMapped(data, data + size, threads, builder);
+    builder.finish();
+    if (data != NULL) {
+        munmap((void*) data, size);
+    }
+    fclose(refFile);
 }
 
-void FastaIndex::flushEntryToIndex(FastaIndexEntry& entry) {
-    string name = split(entry.name, " \t").at(0);  // key by first token of name
-    sequenceNames.push_back(name);
-    this->insert(make_pair(name, FastaIndexEntry(entry.name, entry.length,
-                        entry.offset, entry.line_blen,
-                        entry.line_len)));
+// whether the header of the last sequence in the index still comes just
+// before its bases in the mapped file, as a check that the file has only been
+// appended to
+bool FastaIndex::lastHeaderInPlace(const char* data, long long size) const {
+    if (count == 0) {
+        return true;
+    }
+    size_t last = 0;
+    for (size_t id = 1; id < count; ++id) {
+        if (layouts[id].offset > layouts[last].offset) {
+            last = id;
+        }
+    }
+    long long offset = layouts[last].offset;
+    if (offset <= 0 || offset > size || data[offset - 1] != '\n') {
+        return false;
+    }
+    const char* eol = data + offset - 1;
+    const char* line = eol;
+    while (line > data && line[-1] != '\n') {
+        --line;
+    }
+    size_t length = nameStarts[last + 1] - nameStarts[last];
+    return (*line == '>' || *line == '@') && eol - line > (long long) length
+        && memcmp(line + 1, names + nameStarts[last], length) == 0
+        && isspace(line[1 + length]);
+}
 
+bool FastaIndex::appendReference(string refname, long long from, int threads) {
+    int fd = ::open(refname.c_str(), O_RDONLY);
+    struct stat stFileInfo;
+    if (fd == -1 || fstat(fd, &stFileInfo) != 0 || !S_ISREG(stFileInfo.st_mode)
+        || from < 0 || from > stFileInfo.st_size) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+    long long size = stFileInfo.st_size;
+    if (from == size) {
+        close(fd);
+        return true;
+    }
+    // the whole file is mapped so the offsets line up, but only the new
+    // part of it is touched
+    void* mapped = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+    const char* data = (const char*) mapped;
+    const char* begin = data + from;
+    while (begin < data + size && isspace(*begin)) {
+        ++begin;
+    }
+    bool appended = lastHeaderInPlace(data, size)
+        && (begin == data + size
+            || ((begin == data || begin[-1] == '\n') && (*begin == '>' || *begin == '@')));
+    if (appended) {
+        FastaIndexBuilder builder(*this, begin - data);
+        scanMapped(begin, data + size, threads, builder);
+        builder.finish();
+    }
+    munmap(mapped, size);
+    return appended;
+}
+
+long long FastaIndex::indexedEnd(void) const {
+    const FastaLayout* last = NULL;
+    for (size_t id = 0; id < count; ++id) {
+        // a sequence with no bases has no offset to go by
+        if (layouts[id].offset < 0 || layouts[id].line_blen <= 0) {
+            return -1;
+        }
+        if (last == NULL || layouts[id].offset > last->offset) {
+            last = &layouts[id];
+        }
+    }
+    if (last == NULL) {
+        return -1;
+    }
+    long long segmentStart;
+    FastaLayout l = segmentLayout(*last, last->length - 1, segmentStart);
+    long long lines = (l.length + l.line_blen - 1) / l.line_blen;
+    long long bytes = (lines - 1) * l.line_len + l.length - (lines - 1) * l.line_blen;
+    return (l.qual_offset != -1 ? l.qual_offset : l.offset) + bytes;
 }
 
 void FastaIndex::writeIndexFile(string fname) {
@@ -225,82 +923,748 @@ void FastaIndex::writeIndexFile(string fname) {
 }
 
 FastaIndex::~FastaIndex(void) {
-    indexFile.close();
+    if (mapping != NULL) {
+        munmap(mapping, mappingSize);
+    }
 }
 
-FastaIndexEntry FastaIndex::entry(string name) {
-    FastaIndex::iterator e = this->find(name);
-    if (e == this->end()) {
-        cerr << "unable to find FASTA index entry for '" << name << "'" << endl;
-        exit(1);
-    } else {
-        return e->second;
+// the binary index file starts with this header, followed by the arrays of
+// the index one after another: layouts, nameStarts, slots, segments, the ids
+// in order of name, and names.
+// the arrays are written as they lie in memory, so the byte order and the
+// sizes of the layout and segment records are checked to be those of the
+// reading build.
+struct FastaBinaryIndexHeader {
+    char magic[8];
+    uint32_t byteOrder;
+    uint32_t layoutSize;
+    uint32_t segmentSize;
+    uint32_t reserved;
+    uint64_t referenceSize;
+    int64_t referenceMtime;  // seconds
+    int64_t referenceMtimeNanoseconds;
+    uint64_t count;
+    uint64_t slotCount;
+    uint64_t segmentCount;
+    uint64_t namesSize;
+};
+
+static const char fastaBinaryIndexMagic[8] = { 'F', 'A', 'I', 'B', 'I', 'N', '\0', '\4' };
+static const uint32_t fastaBinaryIndexByteOrder = 0x01020304;
+
+// the time the file was last modified, to the nanosecond
+static const struct timespec& modificationTime(const struct stat& s) {
+#if defined(__APPLE__)
+    return s.st_mtimespec;
+#else
+    return s.st_mtim;
+#endif
+}
+
+bool FastaIndex::readBinaryIndexFile(string fname, const struct stat& reference, long long* indexedSize) {
+    int fd = ::open(fname.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    struct stat stFileInfo;
+    FastaBinaryIndexHeader header;
+    bool valid = fstat(fd, &stFileInfo) == 0
+        && (size_t) stFileInfo.st_size >= sizeof(header)
+        && pread(fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header)
+        && memcmp(header.magic, fastaBinaryIndexMagic, sizeof(header.magic)) == 0
+        && header.byteOrder == fastaBinaryIndexByteOrder
+        && header.layoutSize == sizeof(FastaLayout)
+        && header.segmentSize == sizeof(FastaSegment)
+        && ((header.referenceSize == (uint64_t) reference.st_size
+             && header.referenceMtime == (int64_t) modificationTime(reference).tv_sec
+             && header.referenceMtimeNanoseconds == (int64_t) modificationTime(reference).tv_nsec)
+            || (indexedSize != NULL && header.referenceSize < (uint64_t) reference.st_size))
+        && (uint64_t) stFileInfo.st_size == sizeof(header)
+               + header.count * (sizeof(FastaLayout) + sizeof(uint64_t)) + sizeof(uint64_t)
+               + header.slotCount * sizeof(uint32_t) + header.segmentCount * sizeof(FastaSegment)
+               + header.count * sizeof(uint32_t) + header.namesSize
+        && (header.slotCount & (header.slotCount - 1)) == 0
+        && header.slotCount >= header.count;
+    void* data = MAP_FAILED;
+    if (valid) {
+        data = mmap(NULL, stFileInfo.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    if (mapping != NULL) {
+        munmap(mapping, mappingSize);
+    }
+    mapping = data;
+    mappingSize = stFileInfo.st_size;
+    const char* p = (const char*) data + sizeof(header);
+    count = header.count;
+    slotCount = header.slotCount;
+    segmentCount = header.segmentCount;
+    layouts = (const FastaLayout*) p;
+    p += count * sizeof(FastaLayout);
+    nameStarts = (const uint64_t*) p;
+    p += (count + 1) * sizeof(uint64_t);
+    slots = (const uint32_t*) p;
+    p += slotCount * sizeof(uint32_t);
+    segments = (const FastaSegment*) p;
+    p += segmentCount * sizeof(FastaSegment);
+    sorted = (const uint32_t*) p;
+    p += count * sizeof(uint32_t);
+    namesSorted = true;
+    names = p;
+    if (indexedSize != NULL) {
+        *indexedSize = header.referenceSize;
     }
+    return true;
+}
+
+bool FastaIndex::writeBinaryIndexFile(string fname, const struct stat& reference) {
+    FastaBinaryIndexHeader header;
+    memcpy(header.magic, fastaBinaryIndexMagic, sizeof(header.magic));
+    header.byteOrder = fastaBinaryIndexByteOrder;
+    header.layoutSize = sizeof(FastaLayout);
+    header.segmentSize = sizeof(FastaSegment);
+    header.reserved = 0;
+    header.referenceSize = reference.st_size;
+    header.referenceMtime = modificationTime(reference).tv_sec;
+    header.referenceMtimeNanoseconds = modificationTime(reference).tv_nsec;
+    header.count = count;
+    header.slotCount = slotCount;
+    header.segmentCount = segmentCount;
+    header.namesSize = nameStarts[count];
+    if (!namesSorted) {
+        sortNames();
+    }
+    // write to a temporary file and rename it into place, so that a reader
+    // never sees a partly written index
+    stringstream tmpname;
+    tmpname << fname << ".tmp" << getpid();
+    ofstream out(tmpname.str().c_str(), ios::binary);
+    if (!out.is_open()) {
+        return false;
+    }
+    out.write((const char*) &header, sizeof(header));
+    out.write((const char*) layouts, count * sizeof(FastaLayout));
+    out.write((const char*) nameStarts, (count + 1) * sizeof(uint64_t));
+    out.write((const char*) slots, slotCount * sizeof(uint32_t));
+    out.write((const char*) segments, segmentCount * sizeof(FastaSegment));
+    out.write((const char*) sorted, count * sizeof(uint32_t));
+    out.write(names, header.namesSize);
+    out.close();
+    if (!out || rename(tmpname.str().c_str(), fname.c_str()) != 0) {
+        unlink(tmpname.str().c_str());
+        return false;
+    }
+    return true;
 }
 
 string FastaIndex::indexFileExtension() { return ".fai"; }
 
+string FastaIndex::extendedIndexFileExtension() { return ".fxi"; }
+
+string FastaIndex::binaryIndexFileExtension() { return ".fai.bin"; }
+
 /*
 FastaReference::FastaReference(string reffilename) {
 }
 */
 
-void FastaReference::open(string reffilename) {
+// whether a was modified after b
+static bool timespecNewer(const struct stat& a, const struct stat& b) {
+    const struct timespec& ta = modificationTime(a);
+    const struct timespec& tb = modificationTime(b);
+    return ta.tv_sec > tb.tv_sec || (ta.tv_sec == tb.tv_sec && ta.tv_nsec > tb.tv_nsec);
+}
+
+void FastaReference::open(string reffilename, bool usemmap, bool usebinaryindex) {
     filename = reffilename;
     if (!(file = fopen(filename.c_str(), "r"))) {
         cerr << "could not open " << filename << endl;
         exit(1);
     }
+    if (TwoBitFile::isTwoBit(filename)) {
+        // a .2bit file carries its own index; the offset of each entry is
+        // the number of the sequence within the file
+        twobit = new TwoBitFile();
+        twobit->open(filename);
+        index = new FastaIndex();
+        for (size_t i = 0; i < twobit->sequences.size(); ++i) {
+            const TwoBitSequence& s = twobit->sequences[i];
+            FastaIndexEntry entry(s.name, s.length, i, s.length, s.length);
+            index->flushEntryToIndex(entry);
+        }
+        return;
+    }
+    if (BgzfFile::isGzip(filename)) {
+        if (!BgzfFile::isBgzf(filename)) {
+            cerr << filename << " is compressed with gzip rather than bgzip, so it can't be read at random;"
+                 << " recompress it with bgzip" << endl;
+            exit(1);
+        }
+        bgzf = new BgzfFile();
+        bgzf->open(filename);
+        struct stat stFileInfo;
+        string gziFileName = filename + bgzf->indexFileExtension();
+        if (stat(gziFileName.c_str(), &stFileInfo) == 0) {
+            bgzf->readIndexFile(gziFileName);
+        } else {
+            cerr << "index file " << gziFileName << " not found, generating..." << endl;
+            bgzf->buildIndex();
+            bgzf->writeIndexFile(gziFileName);
+        }
+        usemmap = false;  // there is no use in mapping the compressed bytes
+    }
+    if (usemmap) {
+        struct stat stFileInfo;
+        if (fstat(fileno(file), &stFileInfo) == 0 && stFileInfo.st_size > 0) {
+            filesize = stFileInfo.st_size;
+            filemm = mmap(NULL, filesize, PROT_READ, MAP_SHARED, fileno(file), 0);
+            if (filemm == MAP_FAILED) {
+                cerr << "could not memory-map " << filename << ", falling back to pread" << endl;
+                filemm = NULL;
+                filesize = 0;
+            } else {
+                usingmmap = true;
+            }
+        }
+    }
     index = new FastaIndex();
+    struct stat referenceInfo;
+    bool statted = fstat(fileno(file), &referenceInfo) == 0;
     struct stat stFileInfo; 
-    string indexFileName = filename + index->indexFileExtension(); 
+    string indexFileName = filename + index->indexFileExtension();
+    string extendedIndexFileName = filename + index->extendedIndexFileExtension();
+    string binaryIndexFileName = filename + index->binaryIndexFileExtension();
+    // an index with segments is kept in a .fxi in place of the .fai
+    if (stat(indexFileName.c_str(), &stFileInfo) != 0 && stat(extendedIndexFileName.c_str(), &stFileInfo) == 0) {
+        indexFileName = extendedIndexFileName;
+    }
+    // a reference that has only had sequences appended to it since it was
+    // indexed (bgzip-compressed ones aside) has just the new part indexed
+    bool appendable = statted && bgzf == NULL && S_ISREG(referenceInfo.st_mode);
+    long long indexedSize = 0;
+    if (usebinaryindex && statted
+        && index->readBinaryIndexFile(binaryIndexFileName, referenceInfo, appendable ? &indexedSize : NULL)) {
+        if (!appendable || indexedSize == referenceInfo.st_size) {
+            return;
+        }
+        if (refreshIndex(indexedSize, indexFileName)) {
+            if (!index->writeBinaryIndexFile(binaryIndexFileName, referenceInfo)) {
+                cerr << "could not write binary index file " << binaryIndexFileName << endl;
+            }
+            return;
+        }
+        delete index;
+        index = new FastaIndex();
+    }
     // if we can find an index file, use it
     if(stat(indexFileName.c_str(), &stFileInfo) == 0) { 
         index->readIndexFile(indexFileName);
+        // a reference modified after its index was written has either grown
+        // or must be indexed again
+        if (appendable && timespecNewer(referenceInfo, stFileInfo)
+            && !refreshIndex(index->indexedEnd(), indexFileName)) {
+            cerr << "index file " << indexFileName << " is out of date, regenerating..." << endl;
+            delete index;
+            index = new FastaIndex();
+            index->indexReference(filename);
+            saveIndex(indexFileName);
+        }
     } else { // otherwise, read the reference and generate the index file in the cwd
         cerr << "index file " << indexFileName << " not found, generating..." << endl;
         index->indexReference(filename);
+        saveIndex("");
+    }
+    if (usebinaryindex && !index->writeBinaryIndexFile(binaryIndexFileName, referenceInfo)) {
+        cerr << "could not write binary index file " << binaryIndexFileName << endl;
+    }
+}
+
+// add the sequences after offset from to the index, and rewrite the .fai;
+// false if the reference has changed in some other way than growing
+bool FastaReference::refreshIndex(long long from, const string& indexFileName) {
+    struct stat stFileInfo;
+    if (from < 0 || fstat(fileno(file), &stFileInfo) != 0 || from > stFileInfo.st_size) {
+        return false;
+    }
+    size_t before = index->size();
+    if (!index->appendReference(filename, from)) {
+        return false;
+    }
+    if (index->size() == before) {
+        return true;  // only touched, or blank lines added
+    }
+    cerr << "index file " << indexFileName << " is out of date; sequences appended to the reference: "
+         << index->size() - before << endl;
+    saveIndex(indexFileName);
+    return true;
+}
+
+// write the index next to the reference, as a .fai or, if it has segments,
+// a .fxi, and remove the index file it replaces if that is another file.  an
+// index that replaces an out-of-date one is only warned about if it can't be
+// written (say the directory is read-only), as it is right in memory either way.
+void FastaReference::saveIndex(const string& replaced) {
+    string indexFileName = filename + (index->hasSegments() ? index->extendedIndexFileExtension()
+                                                            : index->indexFileExtension());
+    if (replaced.empty()) {
         index->writeIndexFile(indexFileName);
+        return;
+    }
+    ofstream file(indexFileName.c_str());
+    if (!file.is_open()) {
+        cerr << "could not write index file " << indexFileName << ", using the refreshed index in memory" << endl;
+        return;
+    }
+    file << *index;
+    if (replaced != indexFileName) {
+        unlink(replaced.c_str());
+    }
+}
+
+void FastaReference::enableQueryStats(void) {
+#ifndef FASTA_NO_STATS
+    if (queryStats == NULL) {
+        queryStats = new FastaQueryStats();
     }
+#endif
+}
+
+void FastaReference::reportQueryStats(ostream& out) {
+    if (queryStats == NULL) {
+        out << "query statistics were not collected";
+#ifdef FASTA_NO_STATS
+        out << " (compiled out with FASTA_NO_STATS)";
+#endif
+        out << endl;
+        return;
+    }
+    queryStats->report(out, cache != NULL, cache ? cache->hits() : 0, cache ? cache->misses() : 0);
+}
+
+void FastaReference::setCacheSize(size_t bytes) {
+    delete cache;
+    cache = bytes > 0 ? new FastaBlockCache(bytes) : NULL;
 }
 
 FastaReference::~FastaReference(void) {
+    delete cache;
+    delete queryStats;
+    delete bgzf;
+    delete twobit;
+    if (usingmmap)
+      munmap(filemm, filesize);
     if (file != NULL)
       fclose(file);
     if (index != NULL)
       delete index;
 }
 
-string FastaReference::getSequence(string seqname) {
-    FastaIndexEntry entry = index->entry(seqname);
-    int bytes_per_newline = entry.line_len - entry.line_blen;
-    int newline_bytes_in_sequence = entry.length / entry.line_blen * bytes_per_newline;
-    int seqlen = newline_bytes_in_sequence + entry.length;
-    char* seq = (char*) calloc (seqlen + 1, sizeof(char));
-    fseek64(file, entry.offset, SEEK_SET);
-    string s;
-    if (fread(seq, sizeof(char), seqlen, file)) {
-        seq[seqlen] = '\0';
-        char* pbegin = seq;
-        char* pend = seq + (seqlen/sizeof(char));
-        pend = remove(pbegin, pend, '\r');
-        pend = remove(pbegin, pend, '\n');
-        pend = remove(pbegin, pend, '\0');
-        s = seq;
-        free(seq);
-        s.resize((pend - pbegin)/sizeof(char));
-    }
-    return s;
-}
-
-// TODO cleanup; odd function.  use a map
-string FastaReference::sequenceNameStartingWith(string seqnameStart) {
-    try {
-        return (*index)[seqnameStart].name;
-    } catch (exception& e) {
-        cerr << e.what() << ": unable to find index entry for " << seqnameStart << endl;
+static inline bool isLineEnding(char c) {
+    return c == '\r' || c == '\n' || c == '\0';
+}
+
+// copy the bytes of raw into sequence, dropping any line endings, and stop
+// once length bases have been written; returns the number of bases written.
+// this makes no assumptions about the layout of the lines, so blocks of
+// bytes are tested for line endings with SSE2/AVX2 where available and
+// copied whole when they contain none.
+static long long stripLineEndings(const char* raw, long long bytes, long long length, char* sequence) {
+    const char* p = raw;
+    const char* end = raw + bytes;
+    char* out = sequence;
+    char* limit = sequence + length;
+#if defined(__AVX2__)
+    const __m256i nl32 = _mm256_set1_epi8('\n');
+    const __m256i cr32 = _mm256_set1_epi8('\r');
+    const __m256i nul32 = _mm256_setzero_si256();
+    while (end - p >= 32 && limit - out >= 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*) p);
+        __m256i endings = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, nl32),
+                                                          _mm256_cmpeq_epi8(block, cr32)),
+                                          _mm256_cmpeq_epi8(block, nul32));
+        if (_mm256_movemask_epi8(endings) == 0) {
+            _mm256_storeu_si256((__m256i*) out, block);
+            out += 32;
+        } else {
+            for (int i = 0; i < 32; ++i) {
+                if (!isLineEnding(p[i])) {
+                    *out++ = p[i];
+                }
+            }
+        }
+        p += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i nl16 = _mm_set1_epi8('\n');
+    const __m128i cr16 = _mm_set1_epi8('\r');
+    const __m128i nul16 = _mm_setzero_si128();
+    while (end - p >= 16 && limit - out >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*) p);
+        __m128i endings = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, nl16),
+                                                    _mm_cmpeq_epi8(block, cr16)),
+                                       _mm_cmpeq_epi8(block, nul16));
+        if (_mm_movemask_epi8(endings) == 0) {
+            _mm_storeu_si128((__m128i*) out, block);
+            out += 16;
+        } else {
+            for (int i = 0; i < 16; ++i) {
+                if (!isLineEnding(p[i])) {
+                    *out++ = p[i];
+                }
+            }
+        }
+        p += 16;
+    }
+#endif
+    for (; p != end && out != limit; ++p) {
+        if (!isLineEnding(*p)) {
+            *out++ = *p;
+        }
+    }
+    return out - sequence;
+}
+
+// copy length bases out of raw, which starts column bases into a line, using
+// the line layout from the index: each line is copied whole with memcpy and
+// its line ending stepped over.  if the bytes don't match the layout (the
+// index is stale, say) this falls back to stripping them byte by byte.
+static long long copyLines(const char* raw, long long bytes, long long column, const FastaLayout& entry,
+                           long long length, char* sequence) {
+    const char* p = raw;
+    const char* end = raw + bytes;
+    char* out = sequence;
+    long long remaining = length;
+    long long n = min(remaining, entry.line_blen - column);
+    while (true) {
+        if (end - p < n) {
+            break;
+        }
+        memcpy(out, p, n);
+        out += n;
+        remaining -= n;
+        if (remaining == 0) {
+            return length;
+        }
+        p += n;
+        if (p == end || !isLineEnding(*p)) {
+            break;
+        }
+        p += entry.line_len - entry.line_blen;
+        n = min(remaining, entry.line_blen);
+    }
+    return stripLineEndings(raw, bytes, length, sequence);
+}
+
+long long clipRegion(const FastaLayout& entry, long long start, long long length) {
+    length = min(length, entry.length - start);
+    if (start < 0 || length < 1) {
+        return 0;
+    }
+    return length;
+}
+
+// the byte offset in the file of base pos of the sequence, given that every
+// line but the last holds line_blen bases in line_len bytes
+static long long baseOffset(const FastaLayout& entry, long long pos) {
+    return entry.offset + (long long) (pos / entry.line_blen) * entry.line_len + pos % entry.line_blen;
+}
+
+// read bytes bytes at offset without moving the file position, so several
+// threads can read through the same descriptor; returns the bytes read, and
+// adds the number of calls made to calls
+static long long preadFully(int fd, char* buffer, long long bytes, long long offset, long long& calls) {
+    long long done = 0;
+    while (done < bytes) {
+        ++calls;
+        ssize_t got = pread(fd, buffer + done, bytes - done, offset + done);
+        if (got <= 0) {
+            break;
+        }
+        done += got;
+    }
+    return done;
+}
+
+// read bytes of the (uncompressed) file at offset, decompressing only the
+// blocks needed when it is bgzip-compressed; returns the bytes read
+long long FastaReference::readRaw(char* buffer, long long bytes, long long offset) {
+    FASTA_STATS_TIME(queryStats, FASTA_OP_READ);
+    long long got;
+    long long calls = 0;
+    if (bgzf != NULL) {
+        got = bgzf->read(buffer, bytes, offset);
+    } else {
+        got = preadFully(fileno(file), buffer, bytes, offset, calls);
+    }
+    FASTA_STATS_ADD(queryStats, bytesRead, got);
+    FASTA_STATS_ADD(queryStats, readCalls, calls);
+    return got;
+}
+
+// reads up to this size go through a per-thread buffer that is kept between
+// calls; larger ones (whole chromosomes, say) get their own
+static const long long readBufferBytes = 1 << 20;
+
+// write the (already clipped) region into sequence, which must hold at least
+// length bytes, going through the block cache if there is one.  requests too
+// big to gain from the cache bypass it rather than flushing it.
+long long FastaReference::readSubSequence(const FastaLayout& entry, long long start, long long length, char* sequence) {
+    FASTA_STATS_TIME(queryStats, FASTA_OP_QUERY);
+    FASTA_STATS_ADD(queryStats, queries, 1);
+    FASTA_STATS_ADD(queryStats, basesRequested, length);
+    if (cache == NULL || (size_t) length > cache->capacity / 4) {
+        return readBases(entry, start, length, sequence);
+    }
+    long long blockSize = cache->blockSize;
+    char* out = sequence;
+    for (long long b = start / blockSize; b <= (start + length - 1) / blockSize; ++b) {
+        long long blockStart = b * blockSize;
+        long long blockLength = min(blockSize, entry.length - blockStart);
+        shared_ptr<const string> block = cache->get(entry.offset, b);
+        if (!block) {
+            string* bases = new string(blockLength, '\0');
+            bases->resize(readBases(entry, blockStart, blockLength, &(*bases)[0]));
+            block.reset(bases);
+            cache->put(entry.offset, b, block);
+        }
+        long long from = max((long long) start, blockStart) - blockStart;
+        long long to = min((long long) start + length - blockStart, (long long) block->size());
+        if (to > from) {
+            memcpy(out, block->data() + from, to - from);
+            out += to - from;
+        }
+        if ((long long) block->size() < blockLength) {
+            break;  // the file ended early
+        }
+    }
+    return out - sequence;
+}
+
+// write the (already clipped) region into sequence straight from the file.
+// when the file is memory-mapped the bases are copied out of the mapping;
+// otherwise the raw bytes are read with pread, which leaves the file position
+// alone, so this is safe to call from many threads.
+long long FastaReference::readBases(const FastaLayout& entry, long long start, long long length, char* sequence) {
+    if (twobit != NULL) {
+        FASTA_STATS_TIME(queryStats, FASTA_OP_COPY);
+        return twobit->read(entry.offset, start, length, sequence);
+    }
+    if (entry.segment_count > 0) {
+        // each segment the region covers is read with its own layout
+        long long done = 0;
+        while (done < length) {
+            long long segmentStart;
+            FastaLayout part = index->segmentLayout(entry, start + done, segmentStart);
+            long long n = min(length - done, segmentStart + part.length - (start + done));
+            long long got = readBases(part, start + done - segmentStart, n, sequence + done);
+            done += got;
+            if (got < n) {
+                break;  // the file ended early
+            }
+        }
+        return done;
+    }
+    long long first = baseOffset(entry, start);
+    long long bytes = baseOffset(entry, start + length - 1) - first + 1;
+    if (usingmmap) {
+        bytes = min(bytes, (long long) filesize - first);
+        if (bytes <= 0) {
+            return 0;
+        }
+        FASTA_STATS_ADD(queryStats, bytesRead, bytes);
+        FASTA_STATS_TIME(queryStats, FASTA_OP_COPY);
+        return copyLines((char*) filemm + first, bytes, start % entry.line_blen, entry, length, sequence);
+    }
+    static thread_local vector<char> readbuf;
+    vector<char> largebuf;
+    vector<char>& buffer = bytes <= readBufferBytes ? readbuf : largebuf;
+    if (buffer.size() < (size_t) bytes) {
+        buffer.resize(bytes);
+    }
+    bytes = readRaw(&buffer[0], bytes, first);
+    FASTA_STATS_TIME(queryStats, FASTA_OP_COPY);
+    return copyLines(&buffer[0], bytes, start % entry.line_blen, entry, length, sequence);
+}
+
+// batched reads are grouped while the gap to the next region is at most this
+// many bytes, as reading over a small gap is cheaper than another read, and a
+// group stops growing past the size limit unless regions overlap
+static const long long batchMaxGap = 1 << 12;
+static const long long batchMaxGroupBytes = 1 << 22;
+
+// one region of a batch, with the span of bytes it covers in the file
+struct FastaBatchRead {
+    size_t target;
+    const FastaLayout* entry;
+    long long start;
+    long long length;
+    long long first;  // offset of the first base
+    long long end;    // offset just past the last base
+};
+
+static bool fastaBatchReadCompare(const FastaBatchRead& a, const FastaBatchRead& b) {
+    return a.first < b.first;
+}
+
+void FastaReference::getTargetSubSequences(vector<FastaRegion>& targets, vector<string>& sequences, int threads) {
+    sequences.resize(targets.size());
+    if (twobit != NULL) {
+        // packed sequence is decoded straight from the mapping, so there are
+        // no reads to merge
+        parallelFor(targets.size(), threads, [&](size_t i) {
+            sequences[i] = getTargetSubSequence(targets[i]);
+        });
+        return;
+    }
+    vector<FastaBatchRead> reads;
+    vector<FastaBatchRead> segmented;
+    reads.reserve(targets.size());
+    for (size_t i = 0; i < targets.size(); ++i) {
+        FastaRegion& target = targets[i];
+        FastaBatchRead read;
+        read.target = i;
+        read.entry = &index->layout(getSequenceID(target.startSeq));
+        if (target.startPos == -1) {
+            read.start = 0;
+            read.length = read.entry->length;
+        } else {
+            read.start = target.startPos - 1;
+            read.length = clipRegion(*read.entry, read.start, target.length());
+        }
+        if (read.length <= 0) {
+            sequences[i].clear();
+            continue;
+        }
+        if (read.entry->segment_count > 0) {
+            segmented.push_back(read);  // read on its own, a segment at a time
+            continue;
+        }
+        read.first = baseOffset(*read.entry, read.start);
+        read.end = baseOffset(*read.entry, read.start + read.length - 1) + 1;
+        reads.push_back(read);
+        FASTA_STATS_ADD(queryStats, queries, 1);
+        FASTA_STATS_ADD(queryStats, basesRequested, read.length);
+    }
+    // visit the file in order, merging regions that overlap or lie close
+    // together into a single read
+    sort(reads.begin(), reads.end(), fastaBatchReadCompare);
+    vector<pair<size_t, size_t> > groups;
+    for (size_t i = 0; i < reads.size(); ) {
+        size_t j = i + 1;
+        long long end = reads[i].end;
+        while (j < reads.size() && reads[j].first <= end + batchMaxGap
+               && (reads[j].first < end || reads[j].end - reads[i].first <= batchMaxGroupBytes)) {
+            end = max(end, reads[j].end);
+            ++j;
+        }
+        groups.push_back(make_pair(i, j));
+        i = j;
+    }
+    parallelFor(groups.size(), threads, [&](size_t g) {
+        size_t begin = groups[g].first;
+        size_t stop = groups[g].second;
+        long long first = reads[begin].first;
+        long long end = first;
+        for (size_t i = begin; i < stop; ++i) {
+            end = max(end, reads[i].end);
+        }
+        const char* raw;
+        vector<char> buffer;
+        if (usingmmap) {
+            raw = (char*) filemm + first;
+            end = min(end, (long long) filesize);
+            FASTA_STATS_ADD(queryStats, bytesRead, end - first);
+        } else {
+            buffer.resize(end - first);
+            end = first + readRaw(&buffer[0], end - first, first);
+            raw = &buffer[0];
+        }
+        FASTA_STATS_TIME(queryStats, FASTA_OP_COPY);
+        for (size_t i = begin; i < stop; ++i) {
+            FastaBatchRead& read = reads[i];
+            string& sequence = sequences[read.target];
+            long long bytes = min(read.end, end) - read.first;
+            sequence.resize(read.length);
+            if (bytes <= 0) {
+                sequence.clear();
+                continue;
+            }
+            sequence.resize(copyLines(raw + (read.first - first), bytes, read.start % read.entry->line_blen,
+                                      *read.entry, read.length, &sequence[0]));
+        }
+    });
+    parallelFor(segmented.size(), threads, [&](size_t i) {
+        FastaBatchRead& read = segmented[i];
+        string& sequence = sequences[read.target];
+        sequence.resize(read.length);
+        sequence.resize(readSubSequence(*read.entry, read.start, read.length, &sequence[0]));
+    });
+}
+
+unsigned int FastaReference::getSequenceID(string seqname) {
+    FASTA_STATS_TIME(queryStats, FASTA_OP_LOOKUP);
+    long long id = index->sequenceID(seqname);
+    if (id == -1) {
+        cerr << "unable to find FASTA index entry for '" << seqname << "'" << endl;
         exit(1);
     }
+    return id;
+}
+
+string FastaReference::getSequence(const string& seqname) {
+    return getSequence(getSequenceID(seqname));
+}
+
+void FastaReference::getSequence(const string& seqname, string& sequence) {
+    getSequence(getSequenceID(seqname), sequence);
+}
+
+string FastaReference::getSequence(size_t id) {
+    string sequence;
+    getSequence(id, sequence);
+    return sequence;
+}
+
+void FastaReference::getSequence(size_t id, string& sequence) {
+    const FastaLayout& entry = index->layout(id);
+    sequence.resize(entry.length);
+    if (entry.length > 0) {
+        sequence.resize(readSubSequence(entry, 0, entry.length, &sequence[0]));
+    }
+}
+
+// the name itself if the index holds it, otherwise an empty string
+string FastaReference::sequenceNameStartingWith(string seqnameStart) {
+    if (index->sequenceID(seqnameStart) != -1) {
+        return seqnameStart;
+    }
+    vector<size_t> ids;
+    index->sequencesStartingWith(seqnameStart, ids);
+    return ids.empty() ? "" : index->sequenceName(ids.front());
+}
+
+vector<FastaIndexEntry> FastaReference::findSequencesStartingWith(string seqnameStart) {
+    vector<size_t> ids;
+    index->sequencesStartingWith(seqnameStart, ids);
+    vector<FastaIndexEntry> entries;
+    for (size_t i = 0; i < ids.size(); ++i) {
+        entries.push_back(index->entry(ids[i]));
+    }
+    return entries;
+}
+
+vector<FastaIndexEntry> FastaReference::findSequencesMatching(string pattern) {
+    vector<size_t> ids;
+    index->sequencesMatching(pattern, ids);
+    vector<FastaIndexEntry> entries;
+    for (size_t i = 0; i < ids.size(); ++i) {
+        entries.push_back(index->entry(ids[i]));
+    }
+    return entries;
 }
 
 string FastaReference::getTargetSubSequence(FastaRegion& target) {
@@ -311,41 +1675,264 @@ string FastaReference::getTargetSubSequence(FastaRegion& target) {
     }
 }
 
-string FastaReference::getSubSequence(string seqname, int start, int length) {
-    FastaIndexEntry entry = index->entry(seqname);
-    length = min(length, entry.length - start);
-    if (start < 0 || length < 1) {
-        //cerr << "Empty sequence" << endl;
-        return "";
-    }
-    // we have to handle newlines
-    // approach: count newlines before start
-    //           count newlines by end of read
-    //             subtracting newlines before start find count of embedded newlines
-    int newlines_before = start > 0 ? (start - 1) / entry.line_blen : 0;
-    int newlines_by_end = (start + length - 1) / entry.line_blen;
-    int newlines_inside = newlines_by_end - newlines_before;
-    int bytes_per_newline = entry.line_len - entry.line_blen;
-    int seqlen = length + newlines_inside * bytes_per_newline;
-    char* seq = (char*) calloc (seqlen + 1, sizeof(char));
-    fseek64(file, (off_t) (entry.offset + newlines_before + start), SEEK_SET);
-    string s;
-    if (fread(seq, sizeof(char), (off_t) seqlen, file)) {
-        seq[seqlen] = '\0';
-        char* pbegin = seq;
-        char* pend = seq + (seqlen/sizeof(char));
-        pend = remove(pbegin, pend, '\r');
-        pend = remove(pbegin, pend, '\n');
-        pend = remove(pbegin, pend, '\0');
-        s = seq;
-        free(seq);
-        s.resize((pend - pbegin)/sizeof(char));
-    }
-    return s;
-}
-
-long unsigned int FastaReference::sequenceLength(string seqname) {
-    FastaIndexEntry entry = index->entry(seqname);
-    return entry.length;
+string FastaReference::getSubSequence(const string& seqname, long long start, long long length) {
+    return getSubSequence(getSequenceID(seqname), start, length);
+}
+
+void FastaReference::getSubSequence(const string& seqname, long long start, long long length, string& sequence) {
+    getSubSequence(getSequenceID(seqname), start, length, sequence);
+}
+
+long long FastaReference::getSubSequence(const string& seqname, long long start, long long length, char* sequence) {
+    return getSubSequence(getSequenceID(seqname), start, length, sequence);
+}
+
+string FastaReference::getSubSequence(size_t id, long long start, long long length) {
+    string sequence;
+    getSubSequence(id, start, length, sequence);
+    return sequence;
+}
+
+void FastaReference::getSubSequence(size_t id, long long start, long long length, string& sequence) {
+    const FastaLayout& entry = index->layout(id);
+    length = clipRegion(entry, start, length);
+    sequence.resize(length);
+    if (length > 0) {
+        sequence.resize(readSubSequence(entry, start, length, &sequence[0]));
+    }
+}
+
+long long FastaReference::getSubSequence(size_t id, long long start, long long length, char* sequence) {
+    const FastaLayout& entry = index->layout(id);
+    length = clipRegion(entry, start, length);
+    if (length == 0) {
+        return 0;
+    }
+    return readSubSequence(entry, start, length, sequence);
+}
+
+// the qualities of a fastq read lie out just as its bases do, so they are
+// read through a copy of its layout that starts at the qualities
+FastaLayout FastaReference::qualityLayout(size_t id) {
+    FastaLayout entry = index->layout(id);
+    if (entry.qual_offset == -1) {
+        cerr << "sequence " << index->sequenceName(id) << " has no qualities" << endl;
+        exit(1);
+    }
+    entry.offset = entry.qual_offset;
+    return entry;
+}
+
+string FastaReference::getQuality(size_t id) {
+    string quality;
+    getSubQuality(id, 0, index->layout(id).length, quality);
+    return quality;
+}
+
+void FastaReference::getSubQuality(size_t id, long long start, long long length, string& quality) {
+    FastaLayout entry = qualityLayout(id);
+    length = clipRegion(entry, start, length);
+    quality.resize(length);
+    if (length > 0) {
+        quality.resize(readSubSequence(entry, start, length, &quality[0]));
+    }
+}
+
+string FastaReference::getTargetSubQuality(FastaRegion& target) {
+    size_t id = getSequenceID(target.startSeq);
+    string quality;
+    if (target.startPos == -1) {
+        getSubQuality(id, 0, index->layout(id).length, quality);
+    } else {
+        getSubQuality(id, target.startPos - 1, target.length(), quality);
+    }
+    return quality;
+}
+
+const char* FastaReference::getSubSequenceView(const string& seqname, long long start, long long& length) {
+    if (!usingmmap) {
+        return NULL;
+    }
+    const FastaLayout& entry = index->layout(getSequenceID(seqname));
+    length = clipRegion(entry, start, length);
+    if (length == 0 || entry.segment_count > 0
+        || start / entry.line_blen != (start + length - 1) / entry.line_blen) {
+        return NULL;
+    }
+    FASTA_STATS_ADD(queryStats, queries, 1);
+    FASTA_STATS_ADD(queryStats, basesRequested, length);
+    FASTA_STATS_ADD(queryStats, bytesRead, length);
+    return (char*) filemm + baseOffset(entry, start);
+}
+
+FastaCursor::FastaCursor(FastaReference& reference, size_t id, long long start, long long length,
+                         long long chunkBases, bool readahead)
+    : reference(reference)
+    , chunkBases(max(1LL, chunkBases))
+    , readahead(readahead)
+{
+    init(id, start, length);
+}
+
+FastaCursor::FastaCursor(FastaReference& reference, FastaRegion& target,
+                         long long chunkBases, bool readahead)
+    : reference(reference)
+    , chunkBases(max(1LL, chunkBases))
+    , readahead(readahead)
+{
+    size_t id = reference.getSequenceID(target.startSeq);
+    if (target.startPos == -1) {
+        init(id, 0, reference.index->layout(id).length);
+    } else {
+        init(id, target.startPos - 1, target.length());
+    }
+}
+
+FastaCursor::~FastaCursor(void) {
+    if (worker.joinable()) {
+        {
+            lock_guard<mutex> hold(lock);
+            stopping = true;
+        }
+        changed.notify_all();
+        worker.join();
+    }
+}
+
+void FastaCursor::init(size_t id, long long start, long long length) {
+    entry = &reference.index->layout(id);
+    length = clipRegion(*entry, start, length);
+    this->start = length > 0 ? start : 0;
+    end = this->start + length;
+    following = this->start;
+    chunkStart = this->start;
+    chunkSize = 0;
+    aheadStart = -1;
+    aheadSize = 0;
+    pending = false;
+    requested = false;
+    stopping = false;
+    FASTA_STATS_ADD(reference.queryStats, queries, 1);
+    FASTA_STATS_ADD(reference.queryStats, basesRequested, length);
+}
+
+// read the chunk starting at pos into buffer, returning the bases read
+long long FastaCursor::read(vector<char>& buffer, long long pos) {
+    buffer.resize(min(chunkBases, end - pos));
+    return reference.readBases(*entry, pos, buffer.size(), &buffer[0]);
+}
+
+// have the worker read the chunk at pos into ahead, starting the worker if
+// this is the first readahead
+void FastaCursor::startReadahead(long long pos) {
+    if (!worker.joinable()) {
+        worker = thread(&FastaCursor::work, this);
+    }
+    {
+        lock_guard<mutex> hold(lock);
+        aheadStart = pos;
+        requested = true;
+    }
+    pending = true;
+    changed.notify_all();
+}
+
+// wait for the chunk being read ahead, if there is one, leaving it in ahead
+void FastaCursor::waitForReadahead(void) {
+    if (pending) {
+        unique_lock<mutex> hold(lock);
+        changed.wait(hold, [this]() { return !requested; });
+    }
+}
+
+void FastaCursor::work(void) {
+    unique_lock<mutex> hold(lock);
+    while (true) {
+        changed.wait(hold, [this]() { return requested || stopping; });
+        if (stopping) {
+            return;
+        }
+        long long pos = aheadStart;
+        hold.unlock();
+        long long n = read(ahead, pos);
+        hold.lock();
+        aheadSize = n;
+        requested = false;
+        changed.notify_all();
+    }
+}
+
+bool FastaCursor::next(void) {
+    chunkStart = following;
+    chunkSize = 0;
+    if (following >= end) {
+        return false;
+    }
+    long long n = min(chunkBases, end - following);
+    waitForReadahead();
+    if (pending && aheadStart == following) {
+        chunkSize = aheadSize;
+        chunk.swap(ahead);
+    } else {
+        chunkSize = read(chunk, following);
+    }
+    pending = false;
+    following += chunkSize;
+    if (chunkSize < n) {
+        end = following;  // the file ended early
+    }
+    if (readahead && following < end) {
+        startReadahead(following);
+    }
+    return chunkSize > 0;
+}
+
+void FastaCursor::seek(long long pos) {
+    following = max(start, min(pos, end));
+    chunkSize = 0;
+    if (aheadStart != following) {
+        waitForReadahead();
+        pending = false;
+    }
+}
+
+// hand the clipped region to visit a chunk at a time
+void FastaReference::readChunks(size_t id, long long start, long long length,
+                                const function<void(const char*, int)>& visit) {
+    FASTA_STATS_TIME(queryStats, FASTA_OP_QUERY);
+    FastaCursor cursor(*this, id, start, length);
+    while (cursor.next()) {
+        visit(cursor.data(), cursor.size());
+    }
+}
+
+void FastaReference::writeSequence(size_t id, ostream& out) {
+    writeSubSequence(id, 0, index->layout(id).length, out);
+}
+
+void FastaReference::writeSubSequence(size_t id, long long start, long long length, ostream& out) {
+    readChunks(id, start, length, [&](const char* bases, int n) {
+        FASTA_STATS_TIME(queryStats, FASTA_OP_OUTPUT);
+        out.write(bases, n);
+    });
+}
+
+void FastaReference::getSubSequenceStats(size_t id, long long start, long long length, SequenceStats& stats) {
+    readChunks(id, start, length, [&](const char* bases, int n) {
+        stats.add(bases, n);
+    });
+}
+
+void FastaReference::getTargetSubSequenceStats(FastaRegion& target, SequenceStats& stats) {
+    size_t id = getSequenceID(target.startSeq);
+    if (target.startPos == -1) {
+        getSubSequenceStats(id, 0, index->layout(id).length, stats);
+    } else {
+        getSubSequenceStats(id, target.startPos - 1, target.length(), stats);
+    }
+}
+
+long unsigned int FastaReference::sequenceLength(const string& seqname) {
+    return index->layout(getSequenceID(seqname)).length;
 }
 
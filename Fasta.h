@@ -16,70 +16,338 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <algorithm>
+#include <functional>
+#include <thread>
+#include <condition_variable>
+#include <mutex>
+#include <atomic>
 #include "LargeFileSupport.h"
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include "split.h"
 #include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
 #include <unistd.h>
 #include "Region.h"
+#include "BlockCache.h"
+#include "Bgzf.h"
+#include "TwoBit.h"
+#include "SequenceStats.h"
+#include "QueryStats.h"
 
 using namespace std;
 
-class FastaIndexEntry {
+// where a sequence lies in the file and how its lines are laid out
+struct FastaLayout {
+    long long offset;  // bytes offset of sequence from start of file
+    long long length;  // length of sequence
+    long long line_blen;  // line length in bytes, sequence characters
+    long long line_len;  // line length including newline
+    long long qual_offset;  // bytes offset of the qualities of a fastq read, or -1
+    long long segment;  // the first of the sequence's segments in the index
+    int segment_count;  // 0 if every line but the last has the same layout
+};
+
+// part of a sequence whose lines change length partway through: from base
+// start on, every line but the last of the part has the same layout.  the
+// layout of a sequence with segments is that of its first segment.
+struct FastaSegment {
+    long long offset;  // bytes offset of the first base of the segment
+    long long start;  // the first base of the segment, counting from the start of the sequence
+    long long line_blen;
+    long long line_len;
+};
+
+class FastaIndexEntry : public FastaLayout {
     friend ostream& operator<<(ostream& output, const FastaIndexEntry& e);
     public:
-        FastaIndexEntry(string name, int length, long long offset, int line_blen, int line_len);
+        FastaIndexEntry(string name, long long length, long long offset, long long line_blen, long long line_len,
+                        long long qual_offset = -1);
         FastaIndexEntry(void);
         ~FastaIndexEntry(void);
         string name;  // sequence name
-        int length;  // length of sequence
-        long long offset;  // bytes offset of sequence from start of file
-        int line_blen;  // line length in bytes, sequence characters
-        int line_len;  // line length including newline
+        vector<FastaSegment> segments;  // empty unless the line length changes
         void clear(void);
 };
 
-class FastaIndex : public map<string, FastaIndexEntry> {
+// The index is held in flat arrays addressed by sequence id, which is the
+// order the sequences were added in (file order, for an index built by
+// indexReference): the layout of each sequence, and its name stored in one
+// shared arena of characters.  Names are found through an open-addressing
+// hash table of ids, so a lookup hashes the name once and compares it with
+// one or two candidates.  The arrays are either owned by the index or mapped
+// straight from a binary index file, which needs no parsing at all.
+//
+// For lookups by prefix or pattern, the ids are also kept in order of name,
+// which is built on first use and stored in the binary index, so a query
+// finds the names sharing a prefix by binary search.
+//
+// A sequence whose line length changes partway through is split into
+// segments of uniform lines, kept in one more array.  An index with segments
+// can't be written as a standard .fai, so it goes to a .fxi file instead:
+// the .fai format, with each segmented sequence followed by a line for each
+// of its segments that has an empty name field, then the start, offset,
+// line_blen and line_len of the segment.
+class FastaIndex {
     friend ostream& operator<<(ostream& output, FastaIndex& i);
     public:
         FastaIndex(void);
         ~FastaIndex(void);
-        vector<string> sequenceNames;
-        map<string, unsigned int> sequenceID;
-        void indexReference(string refName);
+        // index the fasta file, scanning chunks of it on up to threads
+        // threads (0 for one per core)
+        void indexReference(string refName, int threads = 0);
+        // index the part of the reference appended since the index was made,
+        // which starts at offset from, adding its sequences to the index.
+        // returns false, leaving the index untouched, unless what follows
+        // from (after any blank lines) is the header of a new sequence.
+        bool appendReference(string refName, long long from, int threads = 0);
+        // the offset just past the last base (or quality) in the file, which
+        // is where appendReference can pick up from; -1 if that can't be
+        // told from the index
+        long long indexedEnd(void) const;
         void readIndexFile(string fname);
         void writeIndexFile(string fname);
-        ifstream indexFile;
-        FastaIndexEntry entry(string key);
+        // the binary index holds the arrays as they lie in memory, along with
+        // the size and modification time of the reference it was made from.
+        // reading maps the file in place; it returns false, leaving the index
+        // untouched, if the file is missing, doesn't match the reference (as
+        // given by stat) or was written by an incompatible build.  if
+        // indexedSize is given, an index of an earlier, smaller version of
+        // the reference is accepted too, and the size it recorded is stored
+        // in *indexedSize so that the rest can be added with appendReference
+        bool readBinaryIndexFile(string fname, const struct stat& reference, long long* indexedSize = NULL);
+        // returns false if the file could not be written
+        bool writeBinaryIndexFile(string fname, const struct stat& reference);
+        // add a sequence to the index, keyed by the first word of its name
         void flushEntryToIndex(FastaIndexEntry& entry);
         string indexFileExtension(void);
+        string extendedIndexFileExtension(void);
+        string binaryIndexFileExtension(void);
+        // whether any sequence has segments, so the index needs a .fxi file
+        bool hasSegments(void) const { return segmentCount > 0; }
+        // the number of sequences in the index
+        size_t size(void) const { return count; }
+        // the id of the sequence with this name, or -1 if there is none
+        long long sequenceID(const string& name) const;
+        string sequenceName(size_t id) const;
+        const FastaLayout& layout(size_t id) const { return layouts[id]; }
+        // the ids of the sequences whose names start with prefix, in order of
+        // name, found in O(log n + k)
+        void sequencesStartingWith(const string& prefix, vector<size_t>& ids) const;
+        // the ids of the sequences whose names match the shell wildcard
+        // pattern (*, ? and [...], as for fnmatch), in order of name.  only the
+        // names sharing the part of the pattern before its first wildcard are
+        // tested, so a pattern such as chrUn_* costs as much as a prefix query
+        void sequencesMatching(const string& pattern, vector<size_t>& ids) const;
+        // the uniform layout of the segment of a sequence that holds base
+        // pos, with positions counted from segmentStart, the first base of
+        // the segment; the layout itself if the sequence has no segments
+        FastaLayout segmentLayout(const FastaLayout& entry, long long pos, long long& segmentStart) const;
+        FastaIndexEntry entry(size_t id) const;
+        // the entry for a sequence name; exits if there is no such sequence
+        FastaIndexEntry entry(const string& key) const;
+    private:
+        // the arrays in use, which point into the storage below or into the
+        // mapped binary index
+        const FastaLayout* layouts;
+        const char* names;  // every name, back to back
+        const uint64_t* nameStarts;  // where each name starts in names, plus the end of the last
+        const uint32_t* slots;  // hash table of id + 1, with 0 for an empty slot
+        const FastaSegment* segments;
+        // every id in order of name, valid once namesSorted is set; built
+        // under sortLock by sortNames when first needed
+        mutable const uint32_t* sorted;
+        mutable vector<uint32_t> sortedStore;
+        mutable atomic<bool> namesSorted;
+        mutable mutex sortLock;
+        void sortNames(void) const;
+        size_t count;
+        size_t slotCount;
+        size_t segmentCount;
+        vector<FastaLayout> layoutStore;
+        vector<FastaSegment> segmentStore;
+        string nameStore;
+        vector<uint64_t> nameStartStore;
+        vector<uint32_t> slotStore;
+        void* mapping;  // the binary index, if one is mapped
+        size_t mappingSize;
+        void useStore(void);
+        bool lastHeaderInPlace(const char* data, long long size) const;
+        void unmap(void);
+        size_t slot(const char* name, size_t length) const;
+        void rehash(size_t slotCount);
 };
 
+// Once open() has returned, getSequence, getSubSequence, getSubSequenceView,
+// writeSequence, getTargetSubSequence(s), the stats methods and
+// sequenceLength may be called concurrently from any number of threads
+// sharing one FastaReference: the index is only read, and the file is read
+// with pread (or through the mapping), so no file position is shared between
+// callers.
 class FastaReference {
+    friend class FastaCursor;
     public:
-        void open(string reffilename);
+        // open the reference, generating its index if needed.  plain,
+        // bgzip-compressed and .2bit files are all accepted.  if usemmap is
+        // set the file is memory-mapped and read through the mapping instead
+        // of with pread.  if usebinaryindex is set the index is mapped from
+        // a binary .fai.bin file next to the reference, which is written from
+        // the .fai when it is missing or out of date
+        void open(string reffilename, bool usemmap = false, bool usebinaryindex = false);
         bool usingmmap;
         string filename;
         FastaReference(void) : usingmmap(false) {
 	  file  = NULL;
 	  index = NULL;
+	  filemm = NULL;
+	  filesize = 0;
+	  cache = NULL;
+	  bgzf = NULL;
+	  twobit = NULL;
+	  queryStats = NULL;
 	}
         ~FastaReference(void);
         FILE* file;
         void* filemm;
         size_t filesize;
         FastaIndex* index;
+        // keep up to bytes of recently read sequence, in blocks with the line
+        // endings already removed, so lookups that fall in a cached block
+        // are served from memory.  0 turns the cache off (the default).
+        void setCacheSize(size_t bytes);
+        FastaBlockCache* cache;
+        // count queries, bytes and read calls, and time each stage of a
+        // query, from now on; a no-op when built with FASTA_NO_STATS.  must
+        // be called before the reference is shared between threads.
+        void enableQueryStats(void);
+        // print the statistics, and the cache hits and misses if there is a cache
+        void reportQueryStats(ostream& out);
+        FastaQueryStats* queryStats;  // NULL unless enabled
+        // set when the reference is bgzip-compressed, in which case the
+        // offsets in the index are offsets into the uncompressed data and the
+        // block offsets are read from (or written to) a .gzi index
+        BgzfFile* bgzf;
+        // set when the reference is a packed .2bit file, which is decoded
+        // directly and has no .fai
+        TwoBitFile* twobit;
+        // the entries of the sequences whose names start with seqnameStart,
+        // or match the wildcard pattern, in order of name
         vector<FastaIndexEntry> findSequencesStartingWith(string seqnameStart);
-        string getSequence(string seqname);
-        // potentially useful for performance, investigate
-        // void getSequence(string seqname, string& sequence);
-        string getSubSequence(string seqname, int start, int length);
+        vector<FastaIndexEntry> findSequencesMatching(string pattern);
+        string getSequence(const string& seqname);
+        // fill sequence in place, reusing its storage from call to call
+        void getSequence(const string& seqname, string& sequence);
+        string getSubSequence(const string& seqname, long long start, long long length);
+        // fill a caller-owned string in place, reusing its storage
+        void getSubSequence(const string& seqname, long long start, long long length, string& sequence);
+        // write into a caller-owned buffer of at least length bytes; returns the
+        // number of bases written.  no terminating NUL is added.
+        long long getSubSequence(const string& seqname, long long start, long long length, char* sequence);
+        // the same, for a sequence id from the index, skipping the name lookup
+        string getSequence(size_t id);
+        void getSequence(size_t id, string& sequence);
+        string getSubSequence(size_t id, long long start, long long length);
+        void getSubSequence(size_t id, long long start, long long length, string& sequence);
+        long long getSubSequence(size_t id, long long start, long long length, char* sequence);
+        // when the file is memory-mapped and the requested bases lie on a
+        // single line, returns a pointer into the mapping and clips length to
+        // the end of the sequence; no copy is made.  returns NULL otherwise,
+        // in which case getSubSequence must be used.
+        const char* getSubSequenceView(const string& seqname, long long start, long long& length);
+        // write a sequence, or part of one, to out without holding it in
+        // memory: the bases are read and written a fixed-size chunk at a time
+        void writeSequence(size_t id, ostream& out);
+        void writeSubSequence(size_t id, long long start, long long length, ostream& out);
+        // add the bases of a region to stats, streaming them in the same way
+        void getSubSequenceStats(size_t id, long long start, long long length, SequenceStats& stats);
+        void getTargetSubSequenceStats(FastaRegion& target, SequenceStats& stats);
         string getTargetSubSequence(FastaRegion& target);
+        // fetch a batch of regions at once, filling sequences[i] for targets[i].
+        // reads are made in file order, regions that overlap or lie close
+        // together share one read, and the work is spread over threads.
+        void getTargetSubSequences(vector<FastaRegion>& targets, vector<string>& sequences, int threads = 0);
+        // the qualities of a fastq read, or of part of one, read and cached
+        // in the same way as its bases; exits if the sequence has none
+        string getQuality(size_t id);
+        void getSubQuality(size_t id, long long start, long long length, string& quality);
+        string getTargetSubQuality(FastaRegion& target);
+        // the first name, in order of name, that starts with seqnameStart (so
+        // the name itself if there is such a sequence); "" if there is none
         string sequenceNameStartingWith(string seqnameStart);
+        // the id of the named sequence in the index; exits if there is none
         unsigned int getSequenceID(string seqname);
-        long unsigned int sequenceLength(string seqname);
+        long unsigned int sequenceLength(const string& seqname);
+    private:
+        bool refreshIndex(long long from, const string& indexFileName);
+        void saveIndex(const string& replaced);
+        FastaLayout qualityLayout(size_t id);
+        long long readSubSequence(const FastaLayout& entry, long long start, long long length, char* sequence);
+        long long readBases(const FastaLayout& entry, long long start, long long length, char* sequence);
+        long long readRaw(char* buffer, long long bytes, long long offset);
+        void readChunks(size_t id, long long start, long long length, const function<void(const char*, int)>& visit);
+};
+
+// clip length so the region of the sequence laid out as entry that starts at
+// start stays within it; returns 0 if the region is empty or starts outside of it
+long long clipRegion(const FastaLayout& entry, long long start, long long length);
+
+// Reads a region of a sequence front to back, a chunk of bases at a time with
+// the line endings removed, into one buffer that is reused from chunk to
+// chunk, so a sequence of any length is walked in fixed memory.  With
+// readahead, the chunk after the current one is read (into a second buffer)
+// while the caller works on the current one, by a worker thread that the
+// cursor starts on its first readahead and keeps until it is destroyed.  The
+// cache is bypassed, as a region walked this way is usually read only once.
+// A cursor is used by one thread at a time; any number of cursors may share
+// a reference.
+class FastaCursor {
+    public:
+        // the length bases from start of sequence id, clipped to the sequence,
+        // chunkBases at a time
+        FastaCursor(FastaReference& reference, size_t id, long long start, long long length,
+                    long long chunkBases = 1 << 19, bool readahead = false);
+        // the bases of target; exits if there is no such sequence
+        FastaCursor(FastaReference& reference, FastaRegion& target,
+                    long long chunkBases = 1 << 19, bool readahead = false);
+        ~FastaCursor(void);
+        FastaCursor(const FastaCursor&) = delete;
+        FastaCursor& operator=(const FastaCursor&) = delete;
+        // read the next chunk; false once the region (or the file) is used up
+        bool next(void);
+        // the bases of the current chunk, valid until the next call to next or seek
+        const char* data(void) const { return chunk.data(); }
+        long long size(void) const { return chunkSize; }
+        // the position in the sequence of the first base of the current chunk
+        long long position(void) const { return chunkStart; }
+        // make the next chunk start at pos in the sequence, clipped to the region
+        void seek(long long pos);
+    private:
+        FastaReference& reference;
+        const FastaLayout* entry;
+        long long start;  // the region
+        long long end;
+        long long chunkBases;
+        bool readahead;
+        long long following;  // where the next chunk starts
+        vector<char> chunk;
+        long long chunkStart;
+        long long chunkSize;
+        vector<char> ahead;  // the chunk being read ahead, if pending is set
+        long long aheadStart;
+        long long aheadSize;
+        bool pending;  // a chunk has been read ahead, or is being
+        // the readahead worker and what it shares with the cursor
+        thread worker;
+        mutex lock;
+        condition_variable changed;
+        bool requested;  // the worker is to read (or is reading) the chunk at aheadStart
+        bool stopping;
+        void init(size_t id, long long start, long long length);
+        long long read(vector<char>& buffer, long long pos);
+        void startReadahead(long long pos);
+        void waitForReadahead(void);
+        void work(void);
 };
 
 #endif
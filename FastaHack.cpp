@@ -1,19 +1,103 @@
 #include "Fasta.h"
 #include <stdlib.h>
 #include <getopt.h>
-#include "disorder.h"
+#include "SequenceStats.h"
+#include "Track.h"
+#include "Motif.h"
+#include "Kmer.h"
+#include "Server.h"
+#include <sstream>
 #include "Region.h"
 
+// parse a byte count such as 4096, 512k, 64m or 2g
+size_t parseSize(const char* arg) {
+    char* suffix;
+    double size = strtod(arg, &suffix);
+    switch (tolower(*suffix)) {
+    case 'g': size *= 1024;  // fall through
+    case 'm': size *= 1024;  // fall through
+    case 'k': size *= 1024;
+    default: break;
+    }
+    return (size_t) size;
+}
+
+// one line of --seqstats output for a region, or just its entropy for
+// --entropy
+void printStats(const string& region, const SequenceStats& stats, bool seqstats) {
+    if (!seqstats) {
+        cout << stats.entropy() << '\n';
+        return;
+    }
+    cout << region << "\t" << stats.length() << "\t" << stats.entropy()
+         << "\t" << stats.gcFraction() << "\t" << stats.nFraction() << "\t" << stats.softmaskedFraction()
+         << "\t" << stats.count('A') << "\t" << stats.count('C') << "\t" << stats.count('G')
+         << "\t" << stats.count('T') << "\t" << stats.count('N') << '\n';
+}
+
+// a region of a fastq file as a fastq record of its bases and qualities
+void printFastqRecord(FastaReference& fr, string region) {
+    FastaRegion target(region);
+    string sequence = fr.getTargetSubSequence(target);
+    string quality = fr.getTargetSubQuality(target);
+    cout << '@' << region << '\n' << sequence << "\n+\n" << quality << '\n';
+}
+
 void printSummary() {
     cerr << "usage: fastahack [options] <fasta reference>" << endl
+         << "       fastahack [options] --serve SOCKET <fasta reference> [<fasta reference> ...]" << endl
+         << "       fastahack [options] --connect SOCKET [<fasta reference>]" << endl
          << endl
          << "options:" << endl 
          << "    -i, --index          generate fasta index <fasta reference>.fai" << endl
+         << "                         (or .fxi, if the line length of a sequence changes)" << endl
          << "    -r, --region REGION  print the specified region" << endl
          << "    -c, --stdin          read a stream of line-delimited region specifiers on stdin" << endl
          << "                         and print the corresponding sequence for each on stdout" << endl
-         << "    -e, --entropy        print the shannon entropy of the specified region" << endl
+         << "    -B, --batch N        with --stdin, read N regions at a time and fetch them in file" << endl
+         << "                         order on --threads threads, printing them in input order" << endl
+         << "    -e, --entropy        print the shannon entropy of the specified region(s)" << endl
+         << "    -s, --seqstats       print statistics of the specified region(s), one line each:" << endl
+         << "                         region, length, entropy, GC, N and soft-masked (lower case)" << endl
+         << "                         fractions, and counts of A, C, G, T and N" << endl
+         << "    -w, --windows SIZE[:STEP]" << endl
+         << "                         print a bedGraph track of --window-stat over windows of SIZE" << endl
+         << "                         bases every STEP bases (default SIZE) along every sequence," << endl
+         << "                         using --threads threads" << endl
+         << "    -W, --window-stat STAT" << endl
+         << "                         the statistic for --windows: gc (default), entropy, n or" << endl
+         << "                         softmasked" << endl
+         << "    -M, --motif [NAME=]PATTERN" << endl
+         << "                         print a BED line for every match of the IUPAC PATTERN on" << endl
+         << "                         either strand of every sequence, using --threads threads;" << endl
+         << "                         may be given more than once" << endl
+         << "    -F, --motif-file FILE" << endl
+         << "                         search for the motifs in FILE, one [NAME=]PATTERN per line" << endl
+         << "    -k, --kmers K        count the canonical K-mers (K up to 32) of the --region, the" << endl
+         << "                         regions on stdin with --stdin, or else every sequence, using" << endl
+         << "                         --threads threads, and print each with its count" << endl
+         << "    -q, --quality        print the specified region(s) of a fastq file as fastq" << endl
+         << "                         records, with their qualities alongside the bases" << endl
+         << "    -n, --names PATTERN  print the names of the sequences that match the shell" << endl
+         << "                         wildcard PATTERN (e.g. 'chrUn_*'), one per line in name" << endl
+         << "                         order, ready to be read back with --stdin" << endl
          << "    -d, --dump           print the fasta file in the form 'seq_name <tab> sequence'" << endl
+         << "    -m, --mmap           memory-map the fasta file instead of reading it with pread" << endl
+         << "    -b, --binary-index   map the index from a binary <fasta reference>.fai.bin, which" << endl
+         << "                         is written from the .fai when missing or out of date" << endl
+         << "    -T, --twobit FILE    write the reference to FILE in packed UCSC .2bit form, which" << endl
+         << "                         fastahack can read in place of the fasta file" << endl
+         << "    -S, --serve SOCKET   keep the references open and answer region requests from" << endl
+         << "                         --connect clients on the Unix socket SOCKET" << endl
+         << "    -X, --connect SOCKET fetch the --region, or the regions on stdin, from the server" << endl
+         << "                         on SOCKET instead of opening the reference; a reference" << endl
+         << "                         given selects one of the server's by its path or file name" << endl
+         << "    -t, --threads N      use N threads (default: one per core)" << endl
+         << "    -C, --cache SIZE     cache up to SIZE bytes (suffix k, m or g) of recently read" << endl
+         << "                         sequence, at least one 16k block (hits and misses are" << endl
+         << "                         reported by --stats)" << endl
+         << "    -Q, --stats          report query counts, bytes read, read calls, cache use and" << endl
+         << "                         the latency of each stage of a query on stderr at exit" << endl
          << endl
          << "REGION is of the form <seq>, <seq>:<start>[sep]<end>, <seq1>:<start>[sep]<seq2>:<end>" << endl
          << "where start and end are 1-based, and the region includes the end position." << endl
@@ -33,13 +117,28 @@ int main (int argc, char** argv) {
     string fastaFileName;
     string seqname;
     string longseqname;
-    long long start;
-    long long length;
     bool dump = false;
 
     bool buildIndex = false;  // flag to force index building
     bool printEntropy = false;  // entropy printing
+    bool printSeqStats = false;
+    bool printQuality = false;
+    long long windowSize = 0;
+    long long windowStep = 0;
+    TrackStat windowStat = TRACK_GC;
+    vector<FastaMotif> motifs;
+    int kmerLength = 0;
+    string namePattern;
     bool readRegionsFromStdin = false;
+    int batchSize = 0;
+    bool useMmap = false;
+    bool useBinaryIndex = false;
+    bool printQueryStats = false;
+    int threads = 0;
+    size_t cacheSize = 0;
+    string twoBitFileName;
+    string serveSocket;
+    string connectSocket;
     //bool printLength = false;
     string region;
 
@@ -55,14 +154,32 @@ int main (int argc, char** argv) {
             {"index",  no_argument, 0, 'i'},
             //{"length",  no_argument, &printLength, true},
             {"entropy", no_argument, 0, 'e'},
+            {"seqstats", no_argument, 0, 's'},
+            {"quality", no_argument, 0, 'q'},
+            {"windows", required_argument, 0, 'w'},
+            {"window-stat", required_argument, 0, 'W'},
+            {"motif", required_argument, 0, 'M'},
+            {"kmers", required_argument, 0, 'k'},
+            {"motif-file", required_argument, 0, 'F'},
             {"region", required_argument, 0, 'r'},
             {"stdin", no_argument, 0, 'c'},
+            {"batch", required_argument, 0, 'B'},
+            {"names", required_argument, 0, 'n'},
+            {"dump", no_argument, 0, 'd'},
+            {"mmap", no_argument, 0, 'm'},
+            {"binary-index", no_argument, 0, 'b'},
+            {"threads", required_argument, 0, 't'},
+            {"cache", required_argument, 0, 'C'},
+            {"stats", no_argument, 0, 'Q'},
+            {"twobit", required_argument, 0, 'T'},
+            {"serve", required_argument, 0, 'S'},
+            {"connect", required_argument, 0, 'X'},
             {0, 0, 0, 0}
         };
         /* getopt_long stores the option index here. */
         int option_index = 0;
 
-        c = getopt_long (argc, argv, "hciedr:",
+        c = getopt_long (argc, argv, "hciesqdmbQr:t:B:C:T:w:W:M:F:k:n:S:X:",
                          long_options, &option_index);
 
       /* Detect the end of the options. */
@@ -85,18 +202,109 @@ int main (int argc, char** argv) {
             printEntropy = true;
             break;
 
+          case 's':
+            printSeqStats = true;
+            break;
+
+          case 'q':
+            printQuality = true;
+            break;
+
+          case 'w':
+            {
+                char* end;
+                windowSize = strtoll(optarg, &end, 10);
+                windowStep = *end == ':' ? strtoll(end + 1, &end, 10) : windowSize;
+                if (*end != '\0' || windowSize < 1 || windowStep < 1) {
+                    cerr << "invalid window specification " << optarg << endl;
+                    exit(1);
+                }
+            }
+            break;
+
+          case 'W':
+            if (!parseTrackStat(optarg, windowStat)) {
+                cerr << "unknown window statistic " << optarg << endl;
+                exit(1);
+            }
+            break;
+
+          case 'M':
+            {
+                FastaMotif motif;
+                if (!parseMotif(optarg, motif)) {
+                    cerr << "invalid motif " << optarg << endl;
+                    exit(1);
+                }
+                motifs.push_back(motif);
+            }
+            break;
+
+          case 'F':
+            readMotifFile(optarg, motifs);
+            break;
+
+          case 'k':
+            kmerLength = atoi(optarg);
+            if (kmerLength < 1 || kmerLength > maxKmerLength) {
+                cerr << "k-mer length must be between 1 and " << maxKmerLength << endl;
+                exit(1);
+            }
+            break;
+
           case 'c':
             readRegionsFromStdin = true;
             break;
+
+          case 'B':
+            batchSize = atoi(optarg);
+            readRegionsFromStdin = true;
+            break;
  
           case 'i':
             buildIndex = true;
             break;
+
+          case 'm':
+            useMmap = true;
+            break;
+
+          case 'b':
+            useBinaryIndex = true;
+            break;
+
+          case 't':
+            threads = atoi(optarg);
+            break;
+
+          case 'C':
+            cacheSize = parseSize(optarg);
+            break;
+
+          case 'Q':
+            printQueryStats = true;
+            break;
+
+          case 'T':
+            twoBitFileName = optarg;
+            break;
+
+          case 'S':
+            serveSocket = optarg;
+            break;
+
+          case 'X':
+            connectSocket = optarg;
+            break;
  
           case 'r':
             region = optarg;
             break;
 
+          case 'n':
+            namePattern = optarg;
+            break;
+
             case 'd':
                 dump = true;
                 break;
@@ -117,6 +325,19 @@ int main (int argc, char** argv) {
           }
       }
 
+    if (connectSocket != "") {
+        // the server has the reference open, so it is only named here
+        string reference = optind < argc ? argv[optind] : "";
+        bool ok;
+        if (region != "") {
+            istringstream regions(region);
+            ok = queryServer(connectSocket, regions, cout, reference);
+        } else {
+            ok = queryServer(connectSocket, cin, cout, reference);
+        }
+        return ok ? 0 : 1;
+    }
+
     /* Print any remaining command line arguments (not options). */
     if (optind < argc) {
         //cerr << "fasta file: " << argv[optind] << endl;
@@ -130,50 +351,192 @@ int main (int argc, char** argv) {
     if (buildIndex) {
         FastaIndex* fai = new FastaIndex();
         //cerr << "generating fasta index file for " << fastaFileName << endl;
-        fai->indexReference(fastaFileName);
-        fai->writeIndexFile((string) fastaFileName + fai->indexFileExtension());
+        fai->indexReference(fastaFileName, threads);
+        // an index whose sequences change line length can't be a .fai
+        fai->writeIndexFile((string) fastaFileName + (fai->hasSegments() ? fai->extendedIndexFileExtension()
+                                                                          : fai->indexFileExtension()));
     }
     
+    if (serveSocket != "") {
+        FastaServer server;
+        for (int i = optind; i < argc; ++i) {
+            // the references stay open for the life of the server, and are
+            // always mapped so that requests are served from memory
+            FastaReference* reference = new FastaReference();
+            reference->open(argv[i], true, useBinaryIndex);
+            reference->setCacheSize(cacheSize);
+            server.addReference(argv[i], reference);
+        }
+        server.serve(serveSocket);
+        return 0;
+    }
+
     string sequence;  // holds sequence so we can optionally process it
 
     FastaReference fr;
-    fr.open(fastaFileName);
+    fr.open(fastaFileName, useMmap, useBinaryIndex);
+    fr.setCacheSize(cacheSize);
+    if (printQueryStats) {
+        fr.enableQueryStats();
+    }
 
-    if (dump) {
-        for (vector<string>::iterator s = fr.index->sequenceNames.begin(); s != fr.index->sequenceNames.end(); ++s) {
-            cout << *s << "\t" << fr.getSequence(*s) << endl;
+    // every mode ends here, so that --stats is reported whatever was asked for
+    auto finish = [&]() {
+        if (printQueryStats) {
+            cout.flush();
+            fr.reportQueryStats(cerr);
         }
         return 0;
+    };
+
+    if (twoBitFileName != "") {
+        TwoBitFile::write(fr, twoBitFileName);
+        return finish();
     }
 
-    if (region != "") {
+    // sequence goes out in large writes; output that must reach the reader
+    // promptly is flushed explicitly
+    setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+
+    if (namePattern != "") {
+        vector<size_t> ids;
+        fr.index->sequencesMatching(namePattern, ids);
+        for (size_t i = 0; i < ids.size(); ++i) {
+            cout << fr.index->sequenceName(ids[i]) << '\n';
+        }
+        return finish();
+    }
+
+    if (dump) {
+        for (size_t id = 0; id < fr.index->size(); ++id) {
+            cout << fr.index->sequenceName(id) << "\t";
+            fr.writeSequence(id, cout);
+            cout << '\n';
+        }
+        return finish();
+    }
+
+    if (windowSize > 0) {
+        writeWindowTrack(fr, windowSize, windowStep, windowStat, threads, cout);
+        return finish();
+    }
+
+    if (!motifs.empty()) {
+        writeMotifHits(fr, motifs, threads, cout);
+        return finish();
+    }
+
+    if (kmerLength > 0) {
+        vector<FastaRegion> targets;
+        string regionstr;
+        if (readRegionsFromStdin) {
+            while (getline(cin, regionstr)) {
+                targets.push_back(FastaRegion(regionstr));
+            }
+        } else if (region != "") {
+            targets.push_back(FastaRegion(region));
+        } else {
+            for (size_t id = 0; id < fr.index->size(); ++id) {
+                // whole sequences, whose names are not parsed as regions
+                targets.push_back(FastaRegion(regionstr));
+                targets.back().startSeq = fr.index->sequenceName(id);
+            }
+        }
+        KmerCounts counts;
+        countKmers(fr, targets, kmerLength, threads, counts);
+        writeKmerCounts(counts, kmerLength, cout);
+        return finish();
+    }
+
+    if (printQuality) {
+        if (region != "" && !readRegionsFromStdin) {
+            printFastqRecord(fr, region);
+        } else if (readRegionsFromStdin) {
+            string regionstr;
+            while (getline(cin, regionstr)) {
+                printFastqRecord(fr, regionstr);
+            }
+        }
+        return finish();
+    }
+
+    bool stats = printEntropy || printSeqStats;
+
+    if (region != "" && !readRegionsFromStdin) {
         FastaRegion target(region);
-        sequence = fr.getTargetSubSequence(target);
+        if (stats) {
+            // statistics are gathered as the bases stream past
+            SequenceStats regionStats;
+            fr.getTargetSubSequenceStats(target, regionStats);
+            if (regionStats.length() > 0) {
+                printStats(region, regionStats, printSeqStats);
+            }
+        } else if (target.startPos == -1) {
+            // whole sequences are streamed rather than read into memory
+            size_t id = fr.getSequenceID(target.startSeq);
+            if (fr.index->layout(id).length > 0) {
+                fr.writeSequence(id, cout);
+                cout << endl;
+            }
+        } else {
+            sequence = fr.getTargetSubSequence(target);
+            if (sequence != "") {
+                cout << sequence << endl;
+            }
+        }
     }
 
-    if (readRegionsFromStdin) {
+    if (readRegionsFromStdin && batchSize > 0) {
+        string regionstr;
+        vector<string> regions;
+        vector<FastaRegion> targets;
+        vector<string> sequences;
+        while (cin) {
+            regions.clear();
+            targets.clear();
+            while (targets.size() < (size_t) batchSize && getline(cin, regionstr)) {
+                regions.push_back(regionstr);
+                targets.push_back(FastaRegion(regionstr));
+            }
+            fr.getTargetSubSequences(targets, sequences, threads);
+            FASTA_STATS_TIME(fr.queryStats, FASTA_OP_OUTPUT);
+            for (size_t i = 0; i < targets.size(); ++i) {
+                if (stats) {
+                    SequenceStats regionStats;
+                    regionStats.add(sequences[i]);
+                    printStats(regions[i], regionStats, printSeqStats);
+                } else {
+                    cout << sequences[i] << '\n';
+                }
+            }
+            cout.flush();
+        }
+    } else if (readRegionsFromStdin) {
         string regionstr;
         while (getline(cin, regionstr)) {
             FastaRegion target(regionstr);
-            if (target.startPos == -1) {
-                cout << fr.getSequence(target.startSeq) << endl;
+            if (stats) {
+                SequenceStats regionStats;
+                fr.getTargetSubSequenceStats(target, regionStats);
+                printStats(regionstr, regionStats, printSeqStats);
+                cout.flush();
+            } else if (target.startPos == -1) {
+                fr.writeSequence(fr.getSequenceID(target.startSeq), cout);
+                cout << endl;
             } else {
-                cout << fr.getSubSequence(target.startSeq, target.startPos - 1, target.length()) << endl;
-            }
-        }
-    } else {
-        if (sequence != "") {
-            if (printEntropy) {
-                if (sequence.size() > 0) {
-                    cout << shannon_H((char*) sequence.c_str(), sequence.size()) << endl;
+                long long length = target.length();
+                const char* view = fr.getSubSequenceView(target.startSeq, target.startPos - 1, length);
+                if (view) {
+                    FASTA_STATS_TIME(fr.queryStats, FASTA_OP_OUTPUT);
+                    cout.write(view, length) << endl;
                 } else {
-                    cerr << "please specify a region or sequence for which to calculate the shannon entropy" << endl;
+                    fr.getSubSequence(target.startSeq, target.startPos - 1, target.length(), sequence);
+                    FASTA_STATS_TIME(fr.queryStats, FASTA_OP_OUTPUT);
+                    cout << sequence << endl;
                 }
-            } else {  // if no statistical processing is requested, just print the sequence
-                cout << sequence << endl;
             }
         }
     }
 
-    return 0;
+    return finish();
 }
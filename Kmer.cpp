@@ -0,0 +1,161 @@
+#include "Kmer.h"
+#include "Parallel.h"
+
+// the 2-bit code of each base, or 4 for anything but A, C, G, T and U
+struct KmerCodes {
+    uint8_t code[256];
+    KmerCodes(void) {
+        memset(code, 4, sizeof(code));
+        const char* bases = "ACGTUacgtu";
+        const uint8_t codes[] = { 0, 1, 2, 3, 3, 0, 1, 2, 3, 3 };
+        for (int i = 0; bases[i]; ++i) {
+            code[(unsigned char) bases[i]] = codes[i];
+        }
+    }
+};
+
+static const KmerCodes kmerCodes;
+
+// bases are streamed into the iterator this many at a time
+static const long long kmerChunkBases = 1 << 16;
+
+KmerIterator::KmerIterator(FastaReference& reference, FastaRegion& target, int k)
+    : cursor(reference, target, kmerChunkBases)
+    , k(k)
+{
+    init();
+}
+
+KmerIterator::KmerIterator(FastaReference& reference, size_t id, long long start, long long length, int k)
+    : cursor(reference, id, start, length, kmerChunkBases)
+    , k(k)
+{
+    init();
+}
+
+void KmerIterator::init(void) {
+    if (k < 1 || k > maxKmerLength) {
+        cerr << "k-mer length must be between 1 and " << maxKmerLength << ", not " << k << endl;
+        exit(1);
+    }
+    valid = 0;
+    forward = 0;
+    reverse = 0;
+    taken = 0;
+}
+
+bool KmerIterator::next(void) {
+    uint64_t mask = k == maxKmerLength ? ~0ULL : (1ULL << (2 * k)) - 1;
+    int shift = 2 * (k - 1);
+    while (true) {
+        if (taken == cursor.size()) {
+            if (!cursor.next()) {
+                return false;
+            }
+            taken = 0;
+        }
+        uint64_t c = kmerCodes.code[(unsigned char) cursor.data()[taken++]];
+        if (c > 3) {
+            valid = 0;
+            continue;
+        }
+        forward = (forward << 2 | c) & mask;
+        reverse = reverse >> 2 | (3 - c) << shift;
+        if (++valid >= k) {
+            return true;
+        }
+    }
+}
+
+string decodeKmer(uint64_t kmer, int k) {
+    string bases(k, 'A');
+    for (int i = k - 1; i >= 0; --i, kmer >>= 2) {
+        bases[i] = "ACGT"[kmer & 3];
+    }
+    return bases;
+}
+
+void KmerCounts::add(size_t shard, const uint64_t* kmers, size_t n) {
+    Shard& s = shards[shard];
+    lock_guard<mutex> hold(s.lock);
+    for (size_t i = 0; i < n; ++i) {
+        ++s.counts[kmers[i]];
+    }
+}
+
+size_t KmerCounts::size(void) const {
+    size_t n = 0;
+    for (size_t i = 0; i < shardCount; ++i) {
+        lock_guard<mutex> hold(shards[i].lock);
+        n += shards[i].counts.size();
+    }
+    return n;
+}
+
+void KmerCounts::sorted(vector<pair<uint64_t, uint64_t> >& counts) const {
+    counts.clear();
+    counts.reserve(size());
+    for (size_t i = 0; i < shardCount; ++i) {
+        lock_guard<mutex> hold(shards[i].lock);
+        counts.insert(counts.end(), shards[i].counts.begin(), shards[i].counts.end());
+    }
+    sort(counts.begin(), counts.end());
+}
+
+// a part of one target counted as a unit: its k-mers are those of the
+// length bases from start, which run on k - 1 bases into the next part
+struct KmerRun {
+    size_t id;
+    long long start;
+    long long length;
+};
+
+// each run owns at most this many k-mers
+static const long long kmerRunBases = 1 << 20;
+
+// the k-mers a thread holds for each shard before adding them
+static const size_t kmerBatchSize = 4096;
+
+void countKmers(FastaReference& reference, vector<FastaRegion>& targets, int k,
+                int threads, KmerCounts& counts) {
+    vector<KmerRun> runs;
+    for (size_t i = 0; i < targets.size(); ++i) {
+        FastaRegion& target = targets[i];
+        size_t id = reference.getSequenceID(target.startSeq);
+        const FastaLayout& layout = reference.index->layout(id);
+        long long start = target.startPos == -1 ? 0 : target.startPos - 1;
+        long long length = clipRegion(layout, start, target.startPos == -1 ? layout.length : target.length());
+        for (long long s = start; s < start + length; s += kmerRunBases) {
+            KmerRun run = { id, s, min(kmerRunBases + k - 1, start + length - s) };
+            runs.push_back(run);
+        }
+    }
+    parallelFor(runs.size(), threads, [&](size_t r) {
+        const KmerRun& run = runs[r];
+        KmerIterator kmers(reference, run.id, run.start, run.length, k);
+        vector<vector<uint64_t> > batches(KmerCounts::shardCount);
+        while (kmers.next()) {
+            uint64_t kmer = kmers.kmer();
+            vector<uint64_t>& batch = batches[KmerCounts::shardOf(kmer)];
+            batch.push_back(kmer);
+            if (batch.size() == kmerBatchSize) {
+                counts.add(KmerCounts::shardOf(kmer), &batch[0], batch.size());
+                batch.clear();
+            }
+        }
+        for (size_t s = 0; s < batches.size(); ++s) {
+            if (!batches[s].empty()) {
+                counts.add(s, &batches[s][0], batches[s].size());
+            }
+        }
+    });
+}
+
+void writeKmerCounts(const KmerCounts& counts, int k, ostream& out) {
+    vector<pair<uint64_t, uint64_t> > sorted;
+    counts.sorted(sorted);
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        out << decodeKmer(sorted[i].first, k) << "\t" << sorted[i].second << '\n';
+    }
+    out.flush();
+}
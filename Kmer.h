@@ -0,0 +1,88 @@
+#ifndef FASTA_KMER_H
+#define FASTA_KMER_H
+
+// K-mers of up to 32 bases packed 2 bits a base (A=0, C=1, G=2, T=3, first
+// base highest), read straight from a reference, and counts of them.
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <mutex>
+#include <unordered_map>
+#include <iostream>
+#include <stdint.h>
+#include "Fasta.h"
+
+using namespace std;
+
+// the longest k-mer that fits in 64 bits
+static const int maxKmerLength = 32;
+
+// Steps through the k-mers of a region a base at a time, updating the k-mer
+// and its reverse complement as each base comes in, and yields the canonical
+// one, the lesser of the two.  The bases are streamed from the reference
+// through a FastaCursor, so a region of any length takes fixed memory.  k-mers
+// holding anything but A, C, G or T (in either case) are skipped.
+class KmerIterator {
+    public:
+        // the k-mers of target, clipped to its sequence; exits if there is no
+        // such sequence or k is not between 1 and maxKmerLength
+        KmerIterator(FastaReference& reference, FastaRegion& target, int k);
+        // the k-mers of the length bases from start of sequence id
+        KmerIterator(FastaReference& reference, size_t id, long long start, long long length, int k);
+        // move to the next k-mer; false once the region is used up
+        bool next(void);
+        // the canonical k-mer
+        uint64_t kmer(void) const { return min(forward, reverse); }
+        // the k-mer as read, on the forward strand
+        uint64_t forwardKmer(void) const { return forward; }
+        // the 0-based position in the sequence of the first base of the k-mer
+        long long position(void) const { return cursor.position() + taken - k; }
+    private:
+        FastaCursor cursor;
+        int k;
+        int valid;  // the number of A, C, G or T bases just taken
+        uint64_t forward;
+        uint64_t reverse;
+        long long taken;  // the bases of the cursor's chunk taken so far
+        void init(void);
+};
+
+// the bases of a packed k-mer
+string decodeKmer(uint64_t kmer, int k);
+
+// A hash table of k-mer counts that any number of threads may add to at
+// once.  It is split into shards by a hash of the k-mer, each a table of its
+// own behind its own lock, and k-mers are added a batch per shard at a time,
+// so a lock is taken once per batch rather than once per k-mer.
+class KmerCounts {
+    public:
+        static const size_t shardCount = 256;
+        // the shard holding kmer
+        static size_t shardOf(uint64_t kmer) { return (kmer * 0x9e3779b97f4a7c15ULL) >> 56; }
+        // count the n k-mers of kmers, which all lie in shard
+        void add(size_t shard, const uint64_t* kmers, size_t n);
+        // the number of distinct k-mers counted
+        size_t size(void) const;
+        // every k-mer with its count, sorted by k-mer (which sorts the bases
+        // alphabetically)
+        void sorted(vector<pair<uint64_t, uint64_t> >& counts) const;
+    private:
+        struct Shard {
+            mutable mutex lock;
+            unordered_map<uint64_t, uint64_t> counts;
+        };
+        Shard shards[shardCount];
+};
+
+// count the canonical k-mers of every target into counts, splitting the
+// targets into runs that are read and counted on up to threads threads (0
+// for one per core).  k-mers of targets that overlap are counted once for
+// each of them.
+void countKmers(FastaReference& reference, vector<FastaRegion>& targets, int k,
+                int threads, KmerCounts& counts);
+
+// write each k-mer and its count, tab separated, in k-mer order
+void writeKmerCounts(const KmerCounts& counts, int k, ostream& out);
+
+#endif
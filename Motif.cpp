@@ -0,0 +1,229 @@
+#include "Motif.h"
+#include "Parallel.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// the mask of each IUPAC code; anything else gets a bit no motif allows, so
+// it never matches
+struct IupacMasks {
+    uint8_t mask[256];
+    IupacMasks(void) {
+        memset(mask, 0x10, sizeof(mask));
+        const char* codes = "ACGTURYSWKMBDHVN";
+        const uint8_t masks[] = { 1, 2, 4, 8, 8, 5, 10, 6, 9, 12, 3, 14, 13, 11, 7, 15 };
+        for (int i = 0; codes[i]; ++i) {
+            mask[(unsigned char) codes[i]] = masks[i];
+            mask[(unsigned char) tolower(codes[i])] = masks[i];
+        }
+    }
+};
+
+static const IupacMasks iupac;
+
+// the mask of the complementary bases: A and T swap, as do C and G
+static uint8_t complementMask(uint8_t mask) {
+    return (mask & 1) << 3 | (mask & 8) >> 3 | (mask & 2) << 1 | (mask & 4) >> 1;
+}
+
+// choose the anchors of a strand: positions allowing only C or G, which are
+// the rarer in most genomes, then those allowing only A or T
+static void motifAnchors(FastaMotifStrand& strand) {
+    int found = 0;
+    strand.anchors[0] = strand.anchors[1] = -1;
+    for (int pass = 0; pass < 2; ++pass) {
+        for (size_t i = 0; i < strand.masks.size() && found < 2; ++i) {
+            uint8_t mask = strand.masks[i];
+            if (pass == 0 ? mask == 2 || mask == 4 : mask == 1 || mask == 8) {
+                strand.anchors[found++] = i;
+            }
+        }
+    }
+}
+
+bool parseMotif(const string& spec, FastaMotif& motif) {
+    size_t equals = spec.find('=');
+    motif.pattern = equals == string::npos ? spec : spec.substr(equals + 1);
+    motif.name = equals == string::npos ? motif.pattern : spec.substr(0, equals);
+    if (motif.pattern.empty() || motif.name.empty()) {
+        return false;
+    }
+    motif.forward.masks.resize(motif.pattern.size());
+    motif.reverse.masks.resize(motif.pattern.size());
+    for (size_t i = 0; i < motif.pattern.size(); ++i) {
+        uint8_t mask = iupac.mask[(unsigned char) motif.pattern[i]];
+        if (mask > 15) {
+            return false;
+        }
+        motif.forward.masks[i] = mask;
+        motif.reverse.masks[motif.pattern.size() - 1 - i] = complementMask(mask);
+    }
+    motifAnchors(motif.forward);
+    motifAnchors(motif.reverse);
+    motif.palindrome = motif.forward.masks == motif.reverse.masks;
+    return true;
+}
+
+void readMotifFile(const string& fileName, vector<FastaMotif>& motifs) {
+    ifstream in(fileName.c_str());
+    if (!in) {
+        cerr << "could not open motif file " << fileName << endl;
+        exit(1);
+    }
+    string line;
+    while (getline(in, line)) {
+        if (!line.empty() && line[line.size() - 1] == '\r') {
+            line.erase(line.size() - 1);
+        }
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        size_t tab = line.find('\t');
+        if (tab != string::npos) {
+            line[tab] = '=';
+        }
+        FastaMotif motif;
+        if (!parseMotif(line, motif)) {
+            cerr << "invalid motif " << line << " in " << fileName << endl;
+            exit(1);
+        }
+        motifs.push_back(motif);
+    }
+}
+
+// a match found in a chunk
+struct MotifHit {
+    long long start;  // in the chunk
+    int motif;
+    char strand;
+    bool operator<(const MotifHit& other) const {
+        if (start != other.start) {
+            return start < other.start;
+        }
+        return motif != other.motif ? motif < other.motif : strand < other.strand;
+    }
+};
+
+// a chunk of one sequence, searched as a unit: matches starting in
+// [start, start + length) are its own, and it reads the bases after it
+// that those matches may run on into
+struct MotifRun {
+    size_t id;
+    long long start;
+    long long length;
+};
+
+// each run owns at most this many bases
+static const long long motifRunBases = 1 << 20;
+
+// add the matches of strand starting in codes before limit to hits.  with
+// SSE2, both anchors are compared at 16 starting positions at a time;
+// otherwise (and for the last few positions) the first anchor's base is found
+// with memchr.  only where the anchors match is the rest of the motif
+// compared.
+static void findMotif(const vector<uint8_t>& codes, long long limit, const FastaMotifStrand& strand,
+                      int motif, char sign, vector<MotifHit>& hits) {
+    const vector<uint8_t>& masks = strand.masks;
+    long long size = masks.size();
+    long long last = min(limit, (long long) codes.size() - size + 1);
+    if (last <= 0) {
+        return;
+    }
+    const uint8_t* begin = &codes[0];
+    auto check = [&](long long p) {
+        long long k = 0;
+        while (k < size && (begin[p + k] & ~masks[k]) == 0) {
+            ++k;
+        }
+        if (k == size) {
+            MotifHit hit = { p, motif, sign };
+            hits.push_back(hit);
+        }
+    };
+    int anchor = strand.anchors[0];
+    if (anchor < 0) {
+        for (long long p = 0; p < last; ++p) {
+            check(p);
+        }
+        return;
+    }
+    long long p = 0;
+#if defined(__SSE2__)
+    int second = strand.anchors[1];
+    if (second >= 0) {
+        const __m128i first16 = _mm_set1_epi8(masks[anchor]);
+        const __m128i second16 = _mm_set1_epi8(masks[second]);
+        for (; p + 16 <= last; p += 16) {
+            __m128i found = _mm_and_si128(
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (begin + p + anchor)), first16),
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (begin + p + second)), second16));
+            for (int candidates = _mm_movemask_epi8(found); candidates != 0; candidates &= candidates - 1) {
+                check(p + __builtin_ctz(candidates));
+            }
+        }
+    }
+#endif
+    const uint8_t* end = begin + last + anchor;
+    for (const uint8_t* a = begin + p + anchor;
+         (a = (const uint8_t*) memchr(a, masks[anchor], end - a)) != NULL; ++a) {
+        check(a - anchor - begin);
+    }
+}
+
+static string motifRun(FastaReference& reference, const MotifRun& run,
+                       const vector<FastaMotif>& motifs, long long longest) {
+    const FastaLayout& layout = reference.index->layout(run.id);
+    long long span = min(layout.length - run.start, run.length + longest - 1);
+    vector<char> bases(span);
+    long long got = reference.getSubSequence(run.id, run.start, span, &bases[0]);
+    vector<uint8_t> codes(got);
+    for (long long i = 0; i < got; ++i) {
+        codes[i] = iupac.mask[(unsigned char) bases[i]];
+    }
+    vector<MotifHit> hits;
+    for (size_t m = 0; m < motifs.size(); ++m) {
+        const FastaMotif& motif = motifs[m];
+        if (motif.palindrome) {
+            findMotif(codes, run.length, motif.forward, m, '.', hits);
+        } else {
+            findMotif(codes, run.length, motif.forward, m, '+', hits);
+            findMotif(codes, run.length, motif.reverse, m, '-', hits);
+        }
+    }
+    sort(hits.begin(), hits.end());
+    ostringstream out;
+    string name = reference.index->sequenceName(run.id);
+    for (size_t i = 0; i < hits.size(); ++i) {
+        const MotifHit& hit = hits[i];
+        const FastaMotif& motif = motifs[hit.motif];
+        out << name << "\t" << run.start + hit.start << "\t" << run.start + hit.start + motif.pattern.size()
+            << "\t" << motif.name << "\t0\t" << hit.strand << '\n';
+    }
+    return out.str();
+}
+
+void writeMotifHits(FastaReference& reference, const vector<FastaMotif>& motifs,
+                    int threads, ostream& out) {
+    long long longest = 1;
+    for (size_t m = 0; m < motifs.size(); ++m) {
+        longest = max(longest, (long long) motifs[m].pattern.size());
+    }
+    vector<MotifRun> runs;
+    for (size_t id = 0; id < reference.index->size(); ++id) {
+        long long length = reference.index->layout(id).length;
+        for (long long start = 0; start < length; start += motifRunBases) {
+            MotifRun run = { id, start, min(motifRunBases, length - start) };
+            runs.push_back(run);
+        }
+    }
+    parallelForOrdered(runs.size(), threads, [&](size_t i) {
+        return motifRun(reference, runs[i], motifs, longest);
+    }, [&](size_t, const string& lines) {
+        out << lines;
+    });
+    out.flush();
+}
@@ -0,0 +1,52 @@
+#ifndef FASTA_MOTIF_H
+#define FASTA_MOTIF_H
+
+// Motif search: every match of a set of IUPAC motifs (restriction sites,
+// guide RNA targets and so on) on both strands of every sequence of a
+// reference, written as BED.
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <stdint.h>
+#include "Fasta.h"
+
+using namespace std;
+
+// the motif or its reverse complement: the bases each position allows, as
+// masks of A=1, C=2, G=4 and T=8, and up to two positions that allow a single
+// base (-1 for each missing), which are looked for before the rest of the
+// motif is compared
+struct FastaMotifStrand {
+    vector<uint8_t> masks;
+    int anchors[2];
+};
+
+struct FastaMotif {
+    string name;              // written in the name column of its hits
+    string pattern;           // the IUPAC codes, as given
+    FastaMotifStrand forward;
+    FastaMotifStrand reverse;
+    // the motif is its own reverse complement, so each match is reported once
+    bool palindrome;
+};
+
+// parse [NAME=]PATTERN, where PATTERN is made of IUPAC codes in either case;
+// the name defaults to the pattern.  returns false if it is not of that form.
+bool parseMotif(const string& spec, FastaMotif& motif);
+
+// read one [NAME=]PATTERN per line of fileName, or NAME and PATTERN
+// separated by a tab, skipping empty lines and lines starting with '#'
+void readMotifFile(const string& fileName, vector<FastaMotif>& motifs);
+
+// write a BED line (sequence, start, end, motif name, 0, strand) to out for
+// every match of motifs in the reference, on + for the motif and on - for its
+// reverse complement, or once on . for a palindrome.  soft-masked bases match
+// as their upper case forms; an ambiguous base in the reference matches only
+// where the motif allows every base it stands for.  sequences are searched in
+// overlapping chunks on up to threads threads (0 for one per core), and the
+// hits are written in order of sequence, then start, then motif.
+void writeMotifHits(FastaReference& reference, const vector<FastaMotif>& motifs,
+                    int threads, ostream& out);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef FASTA_PARALLEL_H
+#define FASTA_PARALLEL_H
+
+// minimal helpers for spreading independent work items over threads
+
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <stddef.h>
+#include <algorithm>
+
+// the number of worker threads to use when the caller does not say
+inline int defaultThreadCount(void) {
+    unsigned int n = std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
+
+// call work(i) for every i in [0, n), handing items out to up to threads
+// workers as they become free.  runs inline when only one thread is useful.
+template <typename Work>
+void parallelFor(size_t n, int threads, Work work) {
+    if (threads < 1) {
+        threads = defaultThreadCount();
+    }
+    if (threads == 1 || n < 2) {
+        for (size_t i = 0; i < n; ++i) {
+            work(i);
+        }
+        return;
+    }
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads && (size_t) t < n; ++t) {
+        workers.push_back(std::thread([&]() {
+            for (size_t i = next++; i < n; i = next++) {
+                work(i);
+            }
+        }));
+    }
+    for (size_t t = 0; t < workers.size(); ++t) {
+        workers[t].join();
+    }
+}
+
+// items of parallelForOrdered are computed this many per thread at a time,
+// then consumed in order, which bounds the results held in memory
+static const int parallelItemsPerThread = 4;
+
+// call consume(i, produce(i)) for every i in [0, n) in order of i, with the
+// produce calls spread over up to threads workers a round at a time
+template <typename Produce, typename Consume>
+void parallelForOrdered(size_t n, int threads, Produce produce, Consume consume) {
+    if (threads < 1) {
+        threads = defaultThreadCount();
+    }
+    size_t round = (size_t) threads * parallelItemsPerThread;
+    std::vector<decltype(produce((size_t) 0))> results;
+    for (size_t first = 0; first < n; first += round) {
+        size_t count = std::min(round, n - first);
+        results.assign(count, decltype(produce((size_t) 0))());
+        parallelFor(count, threads, [&](size_t i) {
+            results[i] = produce(first + i);
+        });
+        for (size_t i = 0; i < count; ++i) {
+            consume(first + i, results[i]);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,67 @@
+#include "QueryStats.h"
+#include <iomanip>
+
+FastaLatencyHistogram::FastaLatencyHistogram(void)
+    : total(0)
+    , sum(0)
+{
+    for (int i = 0; i < bucketCount; ++i) {
+        buckets[i] = 0;
+    }
+}
+
+void FastaLatencyHistogram::record(uint64_t nanoseconds) {
+    // bucket b holds latencies in [2^b, 2^(b+1)), with 0 in bucket 0
+    int b = nanoseconds == 0 ? 0 : 63 - __builtin_clzll(nanoseconds);
+    buckets[b].fetch_add(1, memory_order_relaxed);
+    total.fetch_add(1, memory_order_relaxed);
+    sum.fetch_add(nanoseconds, memory_order_relaxed);
+}
+
+uint64_t FastaLatencyHistogram::percentile(double fraction) const {
+    uint64_t n = total;
+    uint64_t seen = 0;
+    for (int b = 0; b < bucketCount; ++b) {
+        seen += buckets[b];
+        if (n > 0 && seen >= fraction * n) {
+            return b == 63 ? UINT64_MAX : (2ULL << b) - 1;
+        }
+    }
+    return 0;
+}
+
+FastaQueryStats::FastaQueryStats(void)
+    : queries(0)
+    , basesRequested(0)
+    , bytesRead(0)
+    , readCalls(0)
+{}
+
+void FastaQueryStats::report(ostream& out, bool cached, uint64_t cacheHits, uint64_t cacheMisses) const {
+    static const char* names[FASTA_OP_COUNT] = { "query", "lookup", "read", "copy", "output" };
+    out << "queries:          " << queries << endl
+        << "bases requested:  " << basesRequested << endl
+        << "bytes read:       " << bytesRead << endl
+        << "read calls:       " << readCalls << endl;
+    if (cached) {
+        out << "cache:            " << cacheHits << " hits, " << cacheMisses << " misses" << endl;
+    }
+    // percentiles are the upper bounds of power-of-two buckets
+    out << "operation       count    total_ms     mean_us     p50_us<     p90_us<     p99_us<" << endl;
+    ios::fmtflags flags = out.flags();
+    out << fixed << setprecision(3);
+    for (int op = 0; op < FASTA_OP_COUNT; ++op) {
+        const FastaLatencyHistogram& h = latency[op];
+        if (h.count() == 0) {
+            continue;
+        }
+        out << left << setw(9) << names[op] << right
+            << setw(12) << h.count()
+            << setw(12) << h.nanoseconds() / 1e6
+            << setw(12) << h.nanoseconds() / 1e3 / h.count()
+            << setw(12) << h.percentile(0.5) / 1e3
+            << setw(12) << h.percentile(0.9) / 1e3
+            << setw(12) << h.percentile(0.99) / 1e3 << endl;
+    }
+    out.flags(flags);
+}
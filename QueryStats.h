@@ -0,0 +1,93 @@
+#ifndef FASTA_QUERYSTATS_H
+#define FASTA_QUERYSTATS_H
+
+// Counters and latency histograms for the queries a FastaReference answers,
+// kept when FastaReference::enableQueryStats has been called.  Everything is
+// updated with relaxed atomics, so one set of statistics can be shared by all
+// the threads reading a reference.
+//
+// Building with FASTA_NO_STATS defined compiles the instrumentation out
+// entirely.  Otherwise, a reference without statistics enabled pays a single
+// test of a null pointer at each instrumented point.
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <stdint.h>
+
+using namespace std;
+
+enum FastaOperation {
+    FASTA_OP_QUERY,   // reading the bases of a region, once its sequence is found
+    FASTA_OP_LOOKUP,  // finding a sequence by name in the index
+    FASTA_OP_READ,    // reading raw bytes from the file
+    FASTA_OP_COPY,    // copying bases out of raw bytes, dropping line endings
+    FASTA_OP_OUTPUT,  // writing bases out
+    FASTA_OP_COUNT
+};
+
+// a histogram of latencies in power-of-two buckets of nanoseconds
+class FastaLatencyHistogram {
+    public:
+        FastaLatencyHistogram(void);
+        void record(uint64_t nanoseconds);
+        uint64_t count(void) const { return total; }
+        uint64_t nanoseconds(void) const { return sum; }
+        // an upper bound on the latency below which fraction of the samples lie
+        uint64_t percentile(double fraction) const;
+    private:
+        static const int bucketCount = 64;
+        atomic<uint64_t> buckets[bucketCount];
+        atomic<uint64_t> total;
+        atomic<uint64_t> sum;
+};
+
+class FastaQueryStats {
+    public:
+        FastaQueryStats(void);
+        void record(FastaOperation op, uint64_t nanoseconds) { latency[op].record(nanoseconds); }
+        void add(atomic<uint64_t>& counter, uint64_t n) { counter.fetch_add(n, memory_order_relaxed); }
+        atomic<uint64_t> queries;         // requests for bases
+        atomic<uint64_t> basesRequested;  // bases those requests asked for, after clipping
+        atomic<uint64_t> bytesRead;       // raw bytes read from the file or the mapping
+        atomic<uint64_t> readCalls;       // read system calls made
+        FastaLatencyHistogram latency[FASTA_OP_COUNT];
+        // print a summary, with the given cache hits and misses if there is a cache
+        void report(ostream& out, bool cached, uint64_t cacheHits, uint64_t cacheMisses) const;
+};
+
+// times the enclosing scope as op, if stats is not null
+class FastaStatsTimer {
+    public:
+        FastaStatsTimer(FastaQueryStats* stats, FastaOperation op)
+            : stats(stats)
+            , op(op)
+        {
+            if (stats != NULL) {
+                start = chrono::steady_clock::now();
+            }
+        }
+        ~FastaStatsTimer(void) {
+            if (stats != NULL) {
+                stats->record(op, chrono::duration_cast<chrono::nanoseconds>(
+                                  chrono::steady_clock::now() - start).count());
+            }
+        }
+    private:
+        FastaQueryStats* stats;
+        FastaOperation op;
+        chrono::steady_clock::time_point start;
+};
+
+// the instrumentation points; both expect the stats to be in scope as
+// the FastaQueryStats* expression given
+#ifdef FASTA_NO_STATS
+#define FASTA_STATS_TIME(stats, op)
+#define FASTA_STATS_ADD(stats, counter, n)
+#else
+#define FASTA_STATS_TIME(stats, op) FastaStatsTimer fastaStatsTimer(stats, op)
+#define FASTA_STATS_ADD(stats, counter, n) \
+    do { if ((stats) != NULL) (stats)->add((stats)->counter, (n)); } while (0)
+#endif
+
+#endif
@@ -9,8 +9,8 @@ using namespace std;
 class FastaRegion {
 public:
     string startSeq;
-    int startPos;
-    int stopPos;
+    long long startPos;
+    long long stopPos;
 
     FastaRegion(string& region) {
         startPos = -1;
@@ -24,21 +24,21 @@ public:
             size_t foundRangeDots = region.find("..", foundFirstColon);
 	    size_t foundRangeDash = region.find("-", foundFirstColon);
             if (foundRangeDots == string::npos && foundRangeDash == string::npos) {
-                startPos = atoi(region.substr(foundFirstColon + 1).c_str());
+                startPos = strtoll(region.substr(foundFirstColon + 1).c_str(), NULL, 10);
                 stopPos = startPos; // just print one base if we don't give an end
             } else {
 		if (foundRangeDash == string::npos) {
-		    startPos = atoi(region.substr(foundFirstColon + 1, foundRangeDots - foundRangeDots - 1).c_str());
-		    stopPos = atoi(region.substr(foundRangeDots + 2).c_str()); // to the start of this chromosome
+		    startPos = strtoll(region.substr(foundFirstColon + 1, foundRangeDots - foundRangeDots - 1).c_str(), NULL, 10);
+		    stopPos = strtoll(region.substr(foundRangeDots + 2).c_str(), NULL, 10); // to the start of this chromosome
 		} else {
-		    startPos = atoi(region.substr(foundFirstColon + 1, foundRangeDash - foundRangeDash - 1).c_str());
-		    stopPos = atoi(region.substr(foundRangeDash + 1).c_str()); // to the start of this chromosome
+		    startPos = strtoll(region.substr(foundFirstColon + 1, foundRangeDash - foundRangeDash - 1).c_str(), NULL, 10);
+		    stopPos = strtoll(region.substr(foundRangeDash + 1).c_str(), NULL, 10); // to the start of this chromosome
 		}
             }
         }
     }
 
-    int length(void) {
+    long long length(void) {
         if (stopPos > 0) {
             return stopPos - startPos + 1;
         } else {
@@ -0,0 +1,115 @@
+#include "SequenceStats.h"
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+
+SequenceStats::SequenceStats(void) {
+    clear();
+}
+
+void SequenceStats::clear(void) {
+    memset(counts, 0, sizeof(counts));
+    total = 0;
+}
+
+// below this many bytes the lanes cost more to set up than they save
+static const long long statsLaneMinBytes = 4096;
+
+// at most this many bytes are counted into the 32-bit lanes before they are
+// added to the totals, so no lane can overflow
+static const long long statsLaneBytes = 1LL << 30;
+
+// the histogram is kept in four lanes, and eight bytes are loaded at a time
+// and spread over them, so consecutive equal bytes (runs of one base are
+// common) don't all wait on the same counter
+void SequenceStats::add(const char* sequence, long long length) {
+    const unsigned char* p = (const unsigned char*) sequence;
+    if (length < statsLaneMinBytes) {
+        for (long long i = 0; i < length; ++i) {
+            ++counts[p[i]];
+        }
+        total += length;
+        return;
+    }
+    uint32_t lanes[4][256];
+    while (length > 0) {
+        long long n = length < statsLaneBytes ? length : statsLaneBytes;
+        const unsigned char* end = p + n;
+        memset(lanes, 0, sizeof(lanes));
+        for (; end - p >= 8; p += 8) {
+            uint64_t word;
+            memcpy(&word, p, 8);
+            ++lanes[0][word & 0xff];
+            ++lanes[1][(word >> 8) & 0xff];
+            ++lanes[2][(word >> 16) & 0xff];
+            ++lanes[3][(word >> 24) & 0xff];
+            ++lanes[0][(word >> 32) & 0xff];
+            ++lanes[1][(word >> 40) & 0xff];
+            ++lanes[2][(word >> 48) & 0xff];
+            ++lanes[3][word >> 56];
+        }
+        for (; p < end; ++p) {
+            ++lanes[0][*p];
+        }
+        for (int c = 0; c < 256; ++c) {
+            counts[c] += (long long) lanes[0][c] + lanes[1][c] + lanes[2][c] + lanes[3][c];
+        }
+        total += n;
+        length -= n;
+    }
+}
+
+void SequenceStats::remove(const char* sequence, long long length) {
+    const unsigned char* p = (const unsigned char*) sequence;
+    for (long long i = 0; i < length; ++i) {
+        --counts[p[i]];
+    }
+    total -= length;
+}
+
+void SequenceStats::merge(const SequenceStats& other) {
+    for (int c = 0; c < 256; ++c) {
+        counts[c] += other.counts[c];
+    }
+    total += other.total;
+}
+
+long long SequenceStats::count(char base) const {
+    return counts[toupper((unsigned char) base)] + counts[tolower((unsigned char) base)];
+}
+
+// computed in single precision, in the same order as libdisorder's
+// shannon_H, so reported values don't change
+double SequenceStats::entropy(void) const {
+    if (total == 0) {
+        return 0;
+    }
+    float entropy = 0;
+    for (int c = 0; c < 256; ++c) {
+        if (counts[c] != 0) {
+            float p = (float) counts[c] / (float) total;
+            entropy += p * log2f(p);
+        }
+    }
+    return -1.0 * entropy;
+}
+
+double SequenceStats::gcFraction(void) const {
+    return total == 0 ? 0 : (double) (count('G') + count('C')) / total;
+}
+
+double SequenceStats::nFraction(void) const {
+    return total == 0 ? 0 : (double) count('N') / total;
+}
+
+double SequenceStats::softmaskedFraction(void) const {
+    if (total == 0) {
+        return 0;
+    }
+    long long lower = 0;
+    for (int c = 'a'; c <= 'z'; ++c) {
+        lower += counts[c];
+    }
+    return (double) lower / total;
+}
@@ -0,0 +1,40 @@
+#ifndef FASTA_SEQUENCESTATS_H
+#define FASTA_SEQUENCESTATS_H
+
+// Composition statistics of a stretch of sequence, gathered in one pass over
+// the bases.  All of the state lives in the object, so any number of threads
+// can each fill their own, and a long sequence can be fed in pieces.
+
+#include <string>
+
+using namespace std;
+
+class SequenceStats {
+    public:
+        SequenceStats(void);
+        void clear(void);
+        // count the bytes of sequence into the histogram
+        void add(const char* sequence, long long length);
+        void add(const string& sequence) { add(sequence.data(), sequence.size()); }
+        // uncount bytes added before, as when a window slides past them
+        void remove(const char* sequence, long long length);
+        // add the counts of another set of statistics, e.g. from another thread
+        void merge(const SequenceStats& other);
+        // the number of bytes counted
+        long long length(void) const { return total; }
+        // occurrences of base, counting upper and lower case together
+        long long count(char base) const;
+        // shannon entropy in bits of the distribution of byte values, where
+        // upper and lower case are distinct symbols (as libdisorder had it)
+        double entropy(void) const;
+        // fractions of the bases that are G or C, N, and lower case
+        // (soft-masked); 0 when nothing has been counted
+        double gcFraction(void) const;
+        double nFraction(void) const;
+        double softmaskedFraction(void) const;
+        long long counts[256];  // occurrences of each byte value
+    private:
+        long long total;
+};
+
+#endif
@@ -0,0 +1,241 @@
+#include "Server.h"
+#include <thread>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+void FastaServer::addReference(const string& name, FastaReference* reference) {
+    references.push_back(make_pair(name, reference));
+}
+
+// the file name part of a path
+static string baseName(const string& path) {
+    size_t slash = path.rfind('/');
+    return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+// the reference opened as name, or failing that the first with the same
+// file name, so clients may name a reference by another path to it
+FastaReference* FastaServer::findReference(const string& name) {
+    for (size_t i = 0; i < references.size(); ++i) {
+        if (references[i].first == name) {
+            return references[i].second;
+        }
+    }
+    for (size_t i = 0; i < references.size(); ++i) {
+        if (baseName(references[i].first) == baseName(name)) {
+            return references[i].second;
+        }
+    }
+    return NULL;
+}
+
+void FastaServer::answer(const string& request, string& reply) {
+    string region = request;
+    if (!region.empty() && region[region.size() - 1] == '\r') {
+        region.erase(region.size() - 1);
+    }
+    FastaReference* reference = references.empty() ? NULL : references.front().second;
+    size_t tab = region.find('\t');
+    if (tab != string::npos) {
+        string name = region.substr(0, tab);
+        region.erase(0, tab + 1);
+        reference = findReference(name);
+        if (reference == NULL) {
+            reply += "ERROR unknown reference " + name + "\n";
+            return;
+        }
+    }
+    FastaRegion target(region);
+    // look the name up without exiting, unlike the library calls that take names
+    long long id = reference == NULL ? -1 : reference->index->sequenceID(target.startSeq);
+    if (id == -1) {
+        reply += "ERROR unable to find FASTA index entry for '" + target.startSeq + "'\n";
+        return;
+    }
+    long long sequenceLength = reference->index->layout(id).length;
+    long long start = 0;
+    long long length = sequenceLength;
+    if (target.startPos != -1) {
+        start = target.startPos - 1;
+        length = start < 0 || start >= sequenceLength ? 0 : min(target.length(), sequenceLength - start);
+    }
+    size_t at = reply.size();
+    if (length > 0) {
+        reply.resize(at + length);
+        reply.resize(at + reference->getSubSequence(id, start, length, &reply[at]));
+    }
+    reply += '\n';
+}
+
+// write all of data to fd; false if the peer has gone
+static bool sendAll(int fd, const string& data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t sent = send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        done += sent;
+    }
+    return true;
+}
+
+// replies are sent once this much is waiting, or once the requests that have
+// arrived are all answered
+static const size_t serverReplyBytes = 1 << 20;
+
+void FastaServer::serveClient(int fd) {
+    string input;
+    string reply;
+    vector<char> buffer(1 << 16);
+    bool open = true;
+    while (open) {
+        ssize_t got = read(fd, &buffer[0], buffer.size());
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            // answer a last request that has no newline
+            if (!input.empty()) {
+                answer(input, reply);
+                sendAll(fd, reply);
+            }
+            break;
+        }
+        input.append(&buffer[0], got);
+        size_t start = 0;
+        for (size_t end = input.find('\n'); end != string::npos; end = input.find('\n', start)) {
+            answer(input.substr(start, end - start), reply);
+            start = end + 1;
+            if (reply.size() >= serverReplyBytes) {
+                open = sendAll(fd, reply);
+                reply.clear();
+                if (!open) {
+                    break;
+                }
+            }
+        }
+        input.erase(0, start);
+        if (open && !reply.empty()) {
+            open = sendAll(fd, reply);
+            reply.clear();
+        }
+    }
+    close(fd);
+}
+
+// fill addr with the socket path; exits if it is too long for a socket address
+static void socketAddress(const string& socketPath, struct sockaddr_un& addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(addr.sun_path)) {
+        cerr << "socket path " << socketPath << " is too long" << endl;
+        exit(1);
+    }
+    strcpy(addr.sun_path, socketPath.c_str());
+}
+
+void FastaServer::serve(const string& socketPath) {
+    struct sockaddr_un addr;
+    socketAddress(socketPath, addr);
+    struct stat stFileInfo;
+    if (lstat(socketPath.c_str(), &stFileInfo) == 0) {
+        if (!S_ISSOCK(stFileInfo.st_mode)) {
+            cerr << socketPath << " exists and is not a socket" << endl;
+            exit(1);
+        }
+        unlink(socketPath.c_str());
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener == -1 || ::bind(listener, (struct sockaddr*) &addr, sizeof(addr)) != 0
+        || listen(listener, SOMAXCONN) != 0) {
+        cerr << "could not listen on " << socketPath << ": " << strerror(errno) << endl;
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);  // clients that hang up are noticed by send
+    while (true) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            cerr << "could not accept connections on " << socketPath << ": " << strerror(errno) << endl;
+            exit(1);
+        }
+        thread(&FastaServer::serveClient, this, fd).detach();
+    }
+}
+
+// true if nothing is waiting to be read on stdin, as when requests are
+// typed in by hand, so the requests read so far should go out now
+static bool stdinIdle(void) {
+    struct pollfd p = { 0, POLLIN, 0 };
+    return poll(&p, 1, 0) == 0;
+}
+
+bool queryServer(const string& socketPath, istream& in, ostream& out, const string& reference) {
+    struct sockaddr_un addr;
+    socketAddress(socketPath, addr);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        cerr << "could not connect to fastahack server at " << socketPath << ": " << strerror(errno) << endl;
+        exit(1);
+    }
+    // requests are written on their own thread so that they keep flowing
+    // while the answers are read.  they are sent 64k at a time, or sooner if
+    // stdin runs dry, and the rest at the end of the input.
+    thread writer([&]() {
+        string requests;
+        string line;
+        while (getline(in, line)) {
+            if (!reference.empty()) {
+                requests += reference + "\t";
+            }
+            requests += line + "\n";
+            if (requests.size() >= (1 << 16) || (&in == &cin && stdinIdle())) {
+                if (!sendAll(fd, requests)) {
+                    break;
+                }
+                requests.clear();
+            }
+        }
+        sendAll(fd, requests);
+        shutdown(fd, SHUT_WR);
+    });
+    bool ok = true;
+    string input;
+    size_t scanned = 0;  // bytes of input known to hold no newline
+    vector<char> buffer(1 << 16);
+    while (true) {
+        ssize_t got = read(fd, &buffer[0], buffer.size());
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            break;
+        }
+        input.append(&buffer[0], got);
+        size_t start = 0;
+        for (size_t end = input.find('\n', scanned); end != string::npos; end = input.find('\n', start)) {
+            if (input.compare(start, 6, "ERROR ") == 0) {
+                cerr << input.substr(start + 6, end - start - 6) << endl;
+                ok = false;
+            } else {
+                out.write(input.data() + start, end - start + 1);
+            }
+            start = end + 1;
+        }
+        input.erase(0, start);
+        scanned = input.size();
+        out.flush();
+    }
+    writer.join();
+    close(fd);
+    return ok;
+}
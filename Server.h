@@ -0,0 +1,44 @@
+#ifndef FASTA_SERVER_H
+#define FASTA_SERVER_H
+
+// A daemon that keeps references open (index loaded, file mapped) and answers
+// region requests from local clients over a Unix domain socket, so that
+// short-lived jobs don't pay for opening the reference on every query.
+//
+// The protocol is line based.  A request is a region as given to -r,
+// optionally preceded by a reference and a tab; the reference is named by the
+// path the server opened it with or by any path with the same file name, and
+// defaults to the first one.  Every request is answered by one line: the
+// sequence, or "ERROR" followed by a message.  A client may send any number of requests without
+// waiting, and the answers come back in the same order.
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <iostream>
+#include "Fasta.h"
+
+using namespace std;
+
+class FastaServer {
+    public:
+        void addReference(const string& name, FastaReference* reference);
+        // listen on socketPath, replacing any stale socket there, and answer
+        // clients until the process is killed.  each client gets its own
+        // thread; the references are shared between them.
+        void serve(const string& socketPath);
+        // answer one request, appending the reply and its newline to reply
+        void answer(const string& request, string& reply);
+    private:
+        vector<pair<string, FastaReference*> > references;
+        FastaReference* findReference(const string& name);
+        void serveClient(int fd);
+};
+
+// send every request line read from in to the server listening on socketPath,
+// prefixed with reference if it is not empty, and write the sequences that
+// come back to out.  requests are sent while answers are read, so they are
+// pipelined.  errors are reported on stderr; returns false if there were any.
+bool queryServer(const string& socketPath, istream& in, ostream& out, const string& reference);
+
+#endif
@@ -0,0 +1,97 @@
+#include "Track.h"
+#include "Parallel.h"
+#include <sstream>
+
+bool parseTrackStat(const string& name, TrackStat& stat) {
+    if (name == "gc") {
+        stat = TRACK_GC;
+    } else if (name == "entropy") {
+        stat = TRACK_ENTROPY;
+    } else if (name == "n") {
+        stat = TRACK_N;
+    } else if (name == "softmasked") {
+        stat = TRACK_SOFTMASKED;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+double trackValue(const SequenceStats& stats, TrackStat stat) {
+    switch (stat) {
+    case TRACK_GC: return stats.gcFraction();
+    case TRACK_ENTROPY: return stats.entropy();
+    case TRACK_N: return stats.nFraction();
+    case TRACK_SOFTMASKED: return stats.softmaskedFraction();
+    }
+    return 0;
+}
+
+// a run of consecutive windows of one sequence, computed as a unit
+struct TrackRun {
+    size_t id;
+    long long firstWindow;
+    long long windows;
+};
+
+// each run reads at most about this many bases
+static const long long trackRunBases = 1 << 20;
+
+static string windowTrackRun(FastaReference& reference, const TrackRun& run,
+                             long long size, long long step, TrackStat stat) {
+    const FastaLayout& layout = reference.index->layout(run.id);
+    string name = reference.index->sequenceName(run.id);
+    long long start = run.firstWindow * step;
+    long long span = min((long long) layout.length - start, (run.windows - 1) * step + size);
+    vector<char> bases(span);
+    long long got = reference.getSubSequence(run.id, start, span, &bases[0]);
+    ostringstream out;
+    SequenceStats stats;
+    long long windowStart = 0;
+    long long windowEnd = 0;
+    for (long long w = 0; w < run.windows; ++w) {
+        long long nextStart = w * step;
+        long long nextEnd = min(nextStart + size, got);
+        if (nextEnd <= nextStart) {
+            break;  // the file ended early
+        }
+        if (nextStart < windowEnd) {
+            // slide: drop the bases the window has left, count the new ones
+            stats.remove(&bases[windowStart], nextStart - windowStart);
+            stats.add(&bases[windowEnd], nextEnd - windowEnd);
+        } else {
+            stats.clear();
+            stats.add(&bases[nextStart], nextEnd - nextStart);
+        }
+        windowStart = nextStart;
+        windowEnd = nextEnd;
+        out << name << "\t" << start + windowStart << "\t" << start + windowEnd
+            << "\t" << trackValue(stats, stat) << '\n';
+    }
+    return out.str();
+}
+
+void writeWindowTrack(FastaReference& reference, long long size, long long step, TrackStat stat,
+                      int threads, ostream& out) {
+    long long runWindows = max(1LL, (trackRunBases - size) / step + 1);
+    vector<TrackRun> runs;
+    for (size_t id = 0; id < reference.index->size(); ++id) {
+        long long length = reference.index->layout(id).length;
+        if (length == 0) {
+            continue;
+        }
+        // windows start every step bases until one reaches the end
+        long long windows = length <= size ? 1 : (length - size + step - 1) / step + 1;
+        windows = min(windows, (length - 1) / step + 1);
+        for (long long w = 0; w < windows; w += runWindows) {
+            TrackRun run = { id, w, min(runWindows, windows - w) };
+            runs.push_back(run);
+        }
+    }
+    parallelForOrdered(runs.size(), threads, [&](size_t i) {
+        return windowTrackRun(reference, runs[i], size, step, stat);
+    }, [&](size_t, const string& lines) {
+        out << lines;
+    });
+    out.flush();
+}
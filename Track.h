@@ -0,0 +1,36 @@
+#ifndef FASTA_TRACK_H
+#define FASTA_TRACK_H
+
+// Genome tracks: a statistic of the bases in windows slid along every
+// sequence of a reference, written as bedGraph.
+
+#include <string>
+#include <iostream>
+#include "Fasta.h"
+#include "SequenceStats.h"
+
+using namespace std;
+
+enum TrackStat {
+    TRACK_GC,
+    TRACK_ENTROPY,
+    TRACK_N,
+    TRACK_SOFTMASKED
+};
+
+// parse one of gc, entropy, n or softmasked; returns false for anything else
+bool parseTrackStat(const string& name, TrackStat& stat);
+
+// the value of stat for the bases counted in stats
+double trackValue(const SequenceStats& stats, TrackStat stat);
+
+// write the bedGraph track of stat over windows of size bases, starting every
+// step bases along each sequence, to out.  each sequence is read once; runs
+// of consecutive windows are computed on up to threads threads (0 for one per
+// core), with the counts updated as the window slides rather than recounted.
+// the last window of a sequence is the first to reach its end, and may be
+// shorter than size.
+void writeWindowTrack(FastaReference& reference, long long size, long long step, TrackStat stat,
+                      int threads, ostream& out);
+
+#endif
@@ -0,0 +1,293 @@
+#include "TwoBit.h"
+#include "Fasta.h"
+#include <fcntl.h>
+
+static const uint32_t twoBitSignature = 0x1A412743;
+static const uint32_t twoBitSwappedSignature = 0x4327411A;
+
+static uint32_t swapUint32(uint32_t v) {
+    return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+}
+
+// the four bases held in each possible byte of packed sequence
+struct TwoBitUnpackTable {
+    char bases[256][4];
+    TwoBitUnpackTable(void) {
+        const char* code = "TCAG";
+        for (int b = 0; b < 256; ++b) {
+            for (int i = 0; i < 4; ++i) {
+                bases[b][i] = code[(b >> (6 - 2 * i)) & 3];
+            }
+        }
+    }
+};
+
+static const TwoBitUnpackTable& unpackTable(void) {
+    static const TwoBitUnpackTable table;
+    return table;
+}
+
+// the two-bit code of a base, or -1 if it has none
+static int packCode(char base) {
+    switch (base) {
+    case 'T': case 't': return 0;
+    case 'C': case 'c': return 1;
+    case 'A': case 'a': return 2;
+    case 'G': case 'g': return 3;
+    default: return -1;
+    }
+}
+
+TwoBitFile::TwoBitFile(void)
+    : data(NULL)
+    , size(0)
+    , swapped(false)
+{}
+
+TwoBitFile::~TwoBitFile(void) {
+    if (data != NULL)
+        munmap((void*) data, size);
+}
+
+bool TwoBitFile::isTwoBit(const string& filename) {
+    uint32_t signature;
+    ifstream in(filename.c_str(), ios::binary);
+    return in.read((char*) &signature, 4)
+        && (signature == twoBitSignature || signature == twoBitSwappedSignature);
+}
+
+uint32_t TwoBitFile::readUint32(size_t offset) {
+    if (offset + 4 > size) {
+        cerr << "2bit file " << filename << " is truncated" << endl;
+        exit(1);
+    }
+    uint32_t v;
+    memcpy(&v, data + offset, 4);
+    return swapped ? swapUint32(v) : v;
+}
+
+uint64_t TwoBitFile::readUint64(size_t offset) {
+    uint64_t low = readUint32(offset);
+    uint64_t high = readUint32(offset + 4);
+    return swapped ? (low << 32) | high : (high << 32) | low;
+}
+
+void TwoBitFile::open(const string& fname) {
+    filename = fname;
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    struct stat stFileInfo;
+    if (fd == -1 || fstat(fd, &stFileInfo) != 0) {
+        cerr << "could not open " << filename << endl;
+        exit(1);
+    }
+    size = stFileInfo.st_size;
+    void* mapped = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        cerr << "could not memory-map " << filename << endl;
+        exit(1);
+    }
+    data = (const unsigned char*) mapped;
+    swapped = readUint32(0) == twoBitSwappedSignature;
+    uint32_t version = readUint32(4);
+    if (version > 1) {
+        cerr << "unsupported 2bit version " << version << " in " << filename << endl;
+        exit(1);
+    }
+    sequences.resize(readUint32(8));
+    size_t pos = 16;
+    for (size_t i = 0; i < sequences.size(); ++i) {
+        TwoBitSequence& s = sequences[i];
+        if (pos >= size) {
+            readUint32(size);  // reports the truncation
+        }
+        int nameSize = data[pos++];
+        if (pos + nameSize > size) {
+            readUint32(size);
+        }
+        s.name.assign((const char*) data + pos, nameSize);
+        pos += nameSize;
+        size_t record = version == 0 ? readUint32(pos) : readUint64(pos);
+        pos += version == 0 ? 4 : 8;
+        s.length = readUint32(record);
+        vector<uint32_t>* blocks[] = { &s.nStarts, &s.nSizes, &s.maskStarts, &s.maskSizes };
+        record += 4;
+        for (int list = 0; list < 4; list += 2) {
+            uint32_t count = readUint32(record);
+            record += 4;
+            for (int j = 0; j < 2; ++j) {
+                blocks[list + j]->resize(count);
+                for (uint32_t k = 0; k < count; ++k, record += 4) {
+                    (*blocks[list + j])[k] = readUint32(record);
+                }
+            }
+        }
+        s.dnaOffset = record + 4;  // past the reserved word
+        if ((size_t) s.dnaOffset + (s.length + 3) / 4 > size) {
+            readUint32(size);
+        }
+    }
+}
+
+// apply f to the bases of [start, end) that fall in any of the blocks
+template <typename F>
+static void overlayBlocks(const vector<uint32_t>& starts, const vector<uint32_t>& sizes,
+                          long long start, long long end, char* sequence, F f) {
+    // the first block that could overlap is the last one starting at or before start
+    size_t b = upper_bound(starts.begin(), starts.end(), start) - starts.begin();
+    if (b > 0) {
+        --b;
+    }
+    for (; b < starts.size() && starts[b] < end; ++b) {
+        long long from = max(start, (long long) starts[b]);
+        long long to = min(end, (long long) starts[b] + sizes[b]);
+        for (long long p = from; p < to; ++p) {
+            sequence[p - start] = f(sequence[p - start]);
+        }
+    }
+}
+
+static char maskN(char) { return 'N'; }
+static char maskLower(char c) { return tolower(c); }
+
+long long TwoBitFile::read(size_t i, long long start, long long length, char* sequence) {
+    const TwoBitSequence& s = sequences[i];
+    long long end = min(start + length, (long long) s.length);
+    if (start < 0 || start >= end) {
+        return 0;
+    }
+    const unsigned char* packed = data + s.dnaOffset;
+    const TwoBitUnpackTable& table = unpackTable();
+    char* out = sequence;
+    long long pos = start;
+    // bases up to the first byte boundary, then four at a time
+    for (; pos < end && (pos & 3); ++pos) {
+        *out++ = table.bases[packed[pos >> 2]][pos & 3];
+    }
+    for (; end - pos >= 4; pos += 4, out += 4) {
+        memcpy(out, table.bases[packed[pos >> 2]], 4);
+    }
+    for (; pos < end; ++pos) {
+        *out++ = table.bases[packed[pos >> 2]][pos & 3];
+    }
+    overlayBlocks(s.nStarts, s.nSizes, start, end, sequence, maskN);
+    overlayBlocks(s.maskStarts, s.maskSizes, start, end, sequence, maskLower);
+    return end - start;
+}
+
+static void writeUint32(FILE* out, uint32_t v) {
+    fwrite(&v, 4, 1, out);
+}
+
+static void writeBlocks(FILE* out, const vector<uint32_t>& starts, const vector<uint32_t>& sizes) {
+    writeUint32(out, starts.size());
+    for (size_t i = 0; i < starts.size(); ++i) writeUint32(out, starts[i]);
+    for (size_t i = 0; i < sizes.size(); ++i) writeUint32(out, sizes[i]);
+}
+
+// extend the run of blocks when pos continues the last one, else start one
+static void addToBlocks(vector<uint32_t>& starts, vector<uint32_t>& sizes, uint32_t pos) {
+    if (!starts.empty() && starts.back() + sizes.back() == pos) {
+        ++sizes.back();
+    } else {
+        starts.push_back(pos);
+        sizes.push_back(1);
+    }
+}
+
+// sequences are streamed through a cursor this many bases at a time; a
+// multiple of 4, so each chunk packs into whole bytes
+static const long long twoBitChunkBases = 1 << 20;
+
+void TwoBitFile::write(FastaReference& reference, const string& fname) {
+    FastaIndex& index = *reference.index;
+    vector<TwoBitSequence> records(index.size());
+    bool ambiguous = false;
+    // first pass: find the N and soft-masked runs, which fixes the size of
+    // every record and so where each one goes
+    for (size_t i = 0; i < index.size(); ++i) {
+        TwoBitSequence& s = records[i];
+        s.name = index.sequenceName(i);
+        if (s.name.size() > 255) {
+            cerr << "sequence name " << s.name << " is too long to be stored in 2bit format" << endl;
+            exit(1);
+        }
+        if (index.layout(i).length > 0xffffffffLL) {
+            cerr << "sequence " << s.name << " is too long to be stored in 2bit format" << endl;
+            exit(1);
+        }
+        FastaCursor cursor(reference, i, 0, index.layout(i).length, twoBitChunkBases);
+        s.length = 0;
+        while (cursor.next()) {
+            const char* bases = cursor.data();
+            for (long long b = 0; b < cursor.size(); ++b) {
+                char c = bases[b];
+                if (packCode(c) == -1) {
+                    ambiguous = ambiguous || toupper(c) != 'N';
+                    addToBlocks(s.nStarts, s.nSizes, s.length + b);
+                }
+                if (islower(c)) {
+                    addToBlocks(s.maskStarts, s.maskSizes, s.length + b);
+                }
+            }
+            s.length += cursor.size();
+        }
+    }
+    if (ambiguous) {
+        cerr << "warning: bases other than ACGTN can't be stored in 2bit format and are written as N" << endl;
+    }
+    uint64_t recordsSize = 0;
+    uint64_t namesSize = 0;
+    for (size_t i = 0; i < records.size(); ++i) {
+        const TwoBitSequence& s = records[i];
+        namesSize += 1 + s.name.size();
+        recordsSize += 16 + 8 * (s.nStarts.size() + s.maskStarts.size()) + (s.length + 3) / 4;
+    }
+    // version 1 has 64-bit record offsets, for files of 4GB and up
+    uint32_t version = 16 + namesSize + 4 * records.size() + recordsSize > 0xffffffffULL ? 1 : 0;
+    uint64_t offset = 16 + namesSize + (version == 0 ? 4 : 8) * records.size();
+
+    FILE* out = fopen(fname.c_str(), "wb");
+    if (out == NULL) {
+        cerr << "could not open " << fname << " for writing!" << endl;
+        exit(1);
+    }
+    writeUint32(out, twoBitSignature);
+    writeUint32(out, version);
+    writeUint32(out, records.size());
+    writeUint32(out, 0);
+    for (size_t i = 0; i < records.size(); ++i) {
+        const TwoBitSequence& s = records[i];
+        fputc(s.name.size(), out);
+        fwrite(s.name.data(), 1, s.name.size(), out);
+        if (version == 0) {
+            writeUint32(out, offset);
+        } else {
+            fwrite(&offset, 8, 1, out);
+        }
+        offset += 16 + 8 * (s.nStarts.size() + s.maskStarts.size()) + (s.length + 3) / 4;
+    }
+    // second pass: pack the bases
+    vector<unsigned char> packed;
+    for (size_t i = 0; i < records.size(); ++i) {
+        const TwoBitSequence& s = records[i];
+        writeUint32(out, s.length);
+        writeBlocks(out, s.nStarts, s.nSizes);
+        writeBlocks(out, s.maskStarts, s.maskSizes);
+        writeUint32(out, 0);
+        FastaCursor cursor(reference, i, 0, s.length, twoBitChunkBases);
+        while (cursor.next()) {
+            const char* bases = cursor.data();
+            packed.assign((cursor.size() + 3) / 4, 0);
+            for (long long p = 0; p < cursor.size(); ++p) {
+                int code = packCode(bases[p]);
+                packed[p >> 2] |= (code == -1 ? 0 : code) << (6 - 2 * (p & 3));
+            }
+            fwrite(packed.data(), 1, packed.size(), out);
+        }
+    }
+    if (fclose(out) != 0) {
+        cerr << "error writing " << fname << endl;
+        exit(1);
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef FASTA_TWOBIT_H
+#define FASTA_TWOBIT_H
+
+// Reading and writing the UCSC .2bit format, which packs four bases into a
+// byte and keeps runs of N and of lowercase (soft-masked) bases as separate
+// lists of blocks.  A reference held this way needs a quarter of the space
+// of the FASTA it was made from, on disk and in the page cache.
+//
+// The layout, with all integers in the byte order of the machine that wrote
+// the file (detected from the signature):
+//   header:  uint32 signature 0x1A412743, version, sequence count, reserved
+//   index:   per sequence, uint8 name length, name, and the offset of its
+//            record (uint32, or uint64 in version 1)
+//   record:  uint32 length, N block count, N block starts, N block sizes,
+//            mask block count, mask block starts, mask block sizes, reserved,
+//            then the bases packed four to a byte, first base in the high
+//            bits, as T=0 C=1 A=2 G=3
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+class FastaReference;
+
+struct TwoBitSequence {
+    string name;
+    uint32_t length;
+    long long dnaOffset;  // where the packed bases start
+    vector<uint32_t> nStarts;
+    vector<uint32_t> nSizes;
+    vector<uint32_t> maskStarts;
+    vector<uint32_t> maskSizes;
+};
+
+class TwoBitFile {
+    public:
+        TwoBitFile(void);
+        ~TwoBitFile(void);
+        static bool isTwoBit(const string& filename);
+        void open(const string& filename);
+        // decode length bases of sequence i starting at start into sequence,
+        // which must hold length bytes; returns the number of bases written.
+        // safe to call from many threads.
+        long long read(size_t i, long long start, long long length, char* sequence);
+        // write every sequence of the reference to filename in .2bit form.
+        // bases other than ACGTN (IUPAC ambiguity codes) can't be stored and
+        // are written as N.
+        static void write(FastaReference& reference, const string& filename);
+        string filename;
+        vector<TwoBitSequence> sequences;
+    private:
+        const unsigned char* data;  // the whole file, memory-mapped
+        size_t size;
+        bool swapped;  // written on a machine of the other byte order
+        uint32_t readUint32(size_t offset);
+        uint64_t readUint64(size_t offset);
+};
+
+#endif